@@ -53,30 +53,47 @@
 #include <set>
 #include <map>
 #include <algorithm>
+#include <functional>
 #include <exception>
+#include <new>
 #include <cassert>
+#include <climits>
 #include <math.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
 
 // External libraries: gmp(gmpxx)
 #include <gmpxx.h>
 
+// 128-bit words for HybridVector and the modular Berlekamp-Massey.
+#if defined(__SIZEOF_INT128__) && ULONG_MAX > 0xffffffffUL
+#define RANS_INT128
+#endif
+
 namespace rans {
 
 const std::string SYNTAX = 
 "RANS \"simplified\" extended regular expression syntax:      \n"
 "  regex      ::= union* EOP                                  \n"
-"  union      ::= concat ('|' concat)*                        \n"
+"  union      ::= product ('|' product)*                      \n"
+"  product    ::= concat (('&' | '-') concat)*                \n"
+"                 # intersection, difference                  \n"
 "  concat     ::= repetition+                                 \n"
 "  repetition ::= atom quantifier*                            \n"
+"               | '~' repetition # complement (over bytes)    \n"
 "  quantifier ::= [*+?] | '{' (\\d+ | \\d* ',' \\d* ) '}'     \n"
 "  atom       ::= literal | dot | charclass | '(' union ')'   \n"
 "                 utf8char # optional (--utf8)                \n"
 "  charclass  ::= '[' ']'? [^]]* ']'                          \n"
-"  literal    ::= [^*+?[\\]|]                                 \n"
+"                 # codepoints and codepoint ranges (--utf8)  \n"
+"  literal    ::= [^*+?[\\]|&~-]                              \n"
 "  dot        ::= '.' # NOTE: dot matchs also newline('\\n')  \n"
 "  utf8char   ::= [\\x00-\\x7f] | [\\xC0-\\xDF][\\x80-\\xBF]  \n"
 "               | [\\xE0-\\xEF][\\x80-\\xBF]{2}               \n"
-"               | [\\xF0-\\xF7][\\x80-\\xBF]{3}               \n";
+"               | [\\xF0-\\xF7][\\x80-\\xBF]{3}               \n"
+"               | '\\x{' [0-9A-Fa-f]+ '}' # codepoint          \n";
 
 enum Encoding {
   ASCII = 0, // default
@@ -123,6 +140,190 @@ bool is_valid_utf8_sequence(const unsigned char *s)
   return true;
 }
 
+unsigned int utf8_decode(const unsigned char *s)
+{
+  static const unsigned char mask[] = { 0, 0x7F, 0x1F, 0x0F, 0x07 };
+  std::size_t len = utf8_byte_length(*s);
+  unsigned int codepoint = *s & mask[len];
+
+  for (std::size_t i = 1; i < len; i++) codepoint = (codepoint << 6) | (*(s+i) & 0x3F);
+
+  return codepoint;
+}
+
+std::size_t utf8_encode(unsigned int codepoint, unsigned char *s)
+{
+  if (codepoint < 0x80) {
+    s[0] = codepoint;
+    return 1;
+  } else if (codepoint < 0x800) {
+    s[0] = 0xC0 | (codepoint >> 6);
+    s[1] = 0x80 | (codepoint & 0x3F);
+    return 2;
+  } else if (codepoint < 0x10000) {
+    s[0] = 0xE0 | (codepoint >> 12);
+    s[1] = 0x80 | ((codepoint >> 6) & 0x3F);
+    s[2] = 0x80 | (codepoint & 0x3F);
+    return 3;
+  } else {
+    s[0] = 0xF0 | (codepoint >> 18);
+    s[1] = 0x80 | ((codepoint >> 12) & 0x3F);
+    s[2] = 0x80 | ((codepoint >> 6) & 0x3F);
+    s[3] = 0x80 | (codepoint & 0x3F);
+    return 4;
+  }
+}
+
+typedef std::vector<std::pair<unsigned int, unsigned int> > CodepointRanges;
+typedef std::vector<std::pair<unsigned char, unsigned char> > ByteRanges;
+
+const unsigned int kMaxCodepoint = 0x10FFFF;
+
+// sort and merge the ranges, optionally complement them, and drop the
+// surrogates (U+D800-U+DFFF), which are not encodable in UTF-8.
+CodepointRanges& normalize_codepoint_ranges(CodepointRanges& ranges, bool negative)
+{
+  CodepointRanges merged;
+  std::sort(ranges.begin(), ranges.end());
+  for (std::size_t i = 0; i < ranges.size(); i++) {
+    if (ranges[i].first > kMaxCodepoint) break;
+    unsigned int hi = std::min(ranges[i].second, kMaxCodepoint);
+    if (!merged.empty() && ranges[i].first <= merged.back().second + 1) {
+      merged.back().second = std::max(merged.back().second, hi);
+    } else {
+      merged.push_back(std::make_pair(ranges[i].first, hi));
+    }
+  }
+
+  if (negative) {
+    CodepointRanges complement;
+    unsigned int lo = 0;
+    for (std::size_t i = 0; i < merged.size(); i++) {
+      if (lo < merged[i].first) complement.push_back(std::make_pair(lo, merged[i].first - 1));
+      lo = merged[i].second + 1;
+    }
+    if (lo <= kMaxCodepoint) complement.push_back(std::make_pair(lo, kMaxCodepoint));
+    merged.swap(complement);
+  }
+
+  ranges.clear();
+  for (std::size_t i = 0; i < merged.size(); i++) {
+    unsigned int lo = merged[i].first, hi = merged[i].second;
+    if (lo < 0xD800 && hi >= 0xD800) ranges.push_back(std::make_pair(lo, 0xD7FFu));
+    if (hi > 0xDFFF && lo <= 0xDFFF) ranges.push_back(std::make_pair(0xE000u, hi));
+    if (hi < 0xD800 || lo > 0xDFFF) ranges.push_back(merged[i]);
+  }
+
+  return ranges;
+}
+
+// the range of valid second bytes after a lead byte; this excludes overlong
+// forms, surrogates and codepoints above U+10FFFF. returns false if the byte
+// can't start a multibyte sequence.
+bool utf8_second_byte_range(unsigned char lead, unsigned char &lo, unsigned char &hi)
+{
+  lo = 0x80; hi = 0xBF;
+  if (lead < 0xC2 || lead > 0xF4) return false;
+  if (lead == 0xE0) lo = 0xA0;
+  else if (lead == 0xED) hi = 0x9F;
+  else if (lead == 0xF0) lo = 0x90;
+  else if (lead == 0xF4) hi = 0x8F;
+  return true;
+}
+
+// split a codepoint range into sequences of byte ranges which match exactly
+// its UTF-8 encodings, e.g. [\x{80}-\x{7ff}] is [\xC2-\xDF][\x80-\xBF].
+// (the same splitting as RE2's and Go's utf8 range compilation)
+std::vector<ByteRanges>& split_utf8_range(unsigned int lo, unsigned int hi,
+                                          std::vector<ByteRanges>& dst)
+{
+  static const unsigned int max_of_length[] = { 0x7F, 0x7FF, 0xFFFF };
+  CodepointRanges stack(1, std::make_pair(lo, hi));
+
+  while (!stack.empty()) {
+    bool split = false;
+    lo = stack.back().first; hi = stack.back().second;
+    stack.pop_back();
+
+    // 1. both ends must have the same encoded length.
+    for (std::size_t i = 0; i < 3 && !split; i++) {
+      if (lo <= max_of_length[i] && max_of_length[i] < hi) {
+        stack.push_back(std::make_pair(max_of_length[i] + 1, hi));
+        stack.push_back(std::make_pair(lo, max_of_length[i]));
+        split = true;
+      }
+    }
+    if (split) continue;
+
+    if (hi < 0x80) {
+      dst.push_back(ByteRanges(1, std::make_pair(lo, hi)));
+      continue;
+    }
+
+    // 2. below the first differing byte, both ends must span whole ranges.
+    for (std::size_t i = 1; i < 4 && !split; i++) {
+      unsigned int m = (1u << (6 * i)) - 1;
+      if ((lo & ~m) != (hi & ~m)) {
+        if ((lo & m) != 0) {
+          stack.push_back(std::make_pair((lo | m) + 1, hi));
+          stack.push_back(std::make_pair(lo, lo | m));
+          split = true;
+        } else if ((hi & m) != m) {
+          stack.push_back(std::make_pair(hi & ~m, hi));
+          stack.push_back(std::make_pair(lo, (hi & ~m) - 1));
+          split = true;
+        }
+      }
+    }
+    if (split) continue;
+
+    unsigned char lo_bytes[4], hi_bytes[4];
+    std::size_t len = utf8_encode(lo, lo_bytes);
+    utf8_encode(hi, hi_bytes);
+    ByteRanges sequence;
+    for (std::size_t i = 0; i < len; i++) {
+      sequence.push_back(std::make_pair(lo_bytes[i], hi_bytes[i]));
+    }
+    dst.push_back(sequence);
+  }
+
+  return dst;
+}
+
+// limits on the construction of a DFA (or a RANS). 0 means unlimited.
+// bytes are the approximate memory of the subset construction,
+// minimization and ranking matrices.
+struct Limits {
+  Limits(std::size_t states = 0, std::size_t bytes = 0, double seconds = 0):
+      max_states(states), max_bytes(bytes), max_seconds(seconds) {}
+  std::size_t max_states;
+  std::size_t max_bytes;
+  double max_seconds;
+};
+
+// the Limits of a construction started at the Budget's creation (copies
+// share the deadline). check() throws when one of them is exceeded.
+class Budget {
+ public:
+  Budget(const Limits& limits = Limits()): _limits(limits), _start(now()) {}
+  const Limits& limits() const { return _limits; }
+  void check(std::size_t states, std::size_t bytes) const
+  {
+    if (_limits.max_states != 0 && states > _limits.max_states) throw "state limit exceeded";
+    if (_limits.max_bytes != 0 && bytes > _limits.max_bytes) throw "memory limit exceeded";
+    if (_limits.max_seconds != 0 && now() - _start > _limits.max_seconds) throw "time limit exceeded";
+  }
+  static double now()
+  {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+  }
+ private:
+  Limits _limits;
+  double _start;
+};
+
 class Parser {
  public:
   enum ExprType {
@@ -130,39 +331,54 @@ class Parser {
     kConcat, kUnion,
     kStar, kPlus, kRepetition, kQmark,
     kEOP, kLpar, kRpar, kByteRange, kEpsilon,
+    kIntersection, kDifference, kComplement, kAutomaton,
     kBadExpr
   };
+  struct Expr;
+  // a (minimal) DFA inlined into the expression tree as one position per
+  // transition (s, t), whose follow set is the transitions out of t.
+  // see Parser::new_automaton().
+  struct Automaton {
+    Automaton(): bound(0) {}
+    std::vector<Expr*> positions;
+    std::set<Expr*> first, last;
+    std::size_t bound; // when estimating: the states of the product, which isn't built
+  };
   struct Expr {
     Expr() { type = kEpsilon; lhs = rhs = 0; }
     Expr(ExprType t, Expr* lhs = NULL, Expr* rhs = NULL) { init(t, lhs, rhs); }
     void init(ExprType, Expr*, Expr*);
-    void set_union(std::set<Expr*> &src1, std::set<Expr*> &src2, std::set<Expr*> &dst)
-    { dst.insert(src1.begin(), src1.end()); dst.insert(src2.begin(), src2.end()); }
     const char* type_name();
 
     // fiesds
     ExprType type;
     bool nullable;
     unsigned char literal;
-    std::bitset<256> cc_table;
+    const std::bitset<256>* cc_table; // kCharClass only, see Parser::intern()
     Expr* lhs;
     Expr* rhs;
+    Automaton* automaton; // kAutomaton only
     std::size_t id;
+    std::size_t shape; // structural id, 0 until Parser::shape()
     std::set<Expr*> follow;
-    std::set<Expr*> first;
-    std::set<Expr*> last;
     void dump(std::size_t tab);
     friend std::ostream& operator<<(std::ostream&, Expr&);
   };
   
-  Parser(const std::string &, Encoding);
+  Parser(const std::string &, Encoding, bool = false, const Budget& = Budget(), bool = false);
   Expr* expr_tree() { return _expr_root; }
   const std::set<Expr*>& all_expr() const { return _all_expr; }
   Expr* expr(std::size_t);
   Expr* new_expr(ExprType, Expr*, Expr*);
   Expr* clone_expr(Expr*);
+  static std::set<Expr*>& first(Expr*, std::set<Expr*>&);
+  static std::set<Expr*>& last(Expr*, std::set<Expr*>&);
   bool ok() const { return _ok; }
   const std::string& error() const { return _error; }
+  std::size_t reused() const { return _reused; } // products cloned from an equal one
+  std::size_t estimate(bool, bool) const;
+  static std::size_t estimate(Expr*, const std::set<Expr*>&, bool, bool);
+  static std::bitset<256> bytes(const Expr*, bool);
  private:
   ExprType consume();
   ExprType lex();
@@ -181,13 +397,61 @@ class Parser {
 
   void parse();
   Expr* parse_union();
-  Expr* parse_concat();
-  Expr* parse_repetition();
+  Expr* parse_repetition(Expr*);
   Expr* parse_atom();
   Expr* parse_charclass();
+  Expr* parse_utf8_charclass();
+  Expr* new_byte_range(unsigned char, unsigned char);
+  Expr* new_byte_sequences(const std::vector<ByteRanges>&, std::size_t, std::size_t, std::size_t);
+  Expr* new_automaton(ExprType, Expr*, Expr*);
+  Expr* new_product(ExprType, Expr*, Expr*);
+  Automaton* clone_automaton(const Automaton&);
+  const std::bitset<256>* intern(const std::bitset<256>&);
+
+  void fill_transition(Expr *, std::set<Expr*>&);
+  void connect(const std::set<Expr*>&, const std::set<Expr*>&);
+
+  // an open '(' (or the whole regex) while parsing: alternatives so far,
+  // the left operand of a pending '&' or '-', the concatenation of the
+  // current alternative, and the number of '~' before the next repetition.
+  struct Group {
+    Group(const unsigned char* b = NULL):
+        begin(b), alternation(NULL), operand(NULL), concatenation(NULL), complements(0) {}
+    const unsigned char* begin; // the '(', NULL for the whole regex
+    Expr* alternation;
+    Expr* operand;
+    ExprType op;
+    Expr* concatenation;
+    std::size_t complements;
+  };
+  Expr* close_product(Group&);
+
+  // the structure of a node: its type, literal, class table (or the
+  // operator of a product) and the ids of its operands. equal trees get
+  // the same id however they are spelled ("\d" and "[0-9]" share a table),
+  // and products are memoized by it. see Parser::shape().
+  struct Shape {
+    Shape(ExprType t, std::size_t v, std::size_t l, std::size_t r): type(t), value(v), lhs(l), rhs(r) {}
+    bool operator<(const Shape& s) const {
+      if (type != s.type) return type < s.type;
+      if (value != s.value) return value < s.value;
+      if (lhs != s.lhs) return lhs < s.lhs;
+      return rhs < s.rhs;
+    }
+    ExprType type;
+    std::size_t value, lhs, rhs;
+  };
+  std::size_t shape(Expr*);
 
-  void fill_transition(Expr *);
-  void connect(std::set<Expr*>, std::set<Expr*>);
+  // class tables live apart from the nodes, one per distinct class.
+  struct CCTableLess {
+    bool operator()(const std::bitset<256>* a, const std::bitset<256>* b) const {
+      for (std::size_t c = 0; c < 256; c++) {
+        if ((*a)[c] != (*b)[c]) return (*b)[c];
+      }
+      return false;
+    }
+  };
 
   // fields
   static const int repeat_infinitely = -1;
@@ -195,14 +459,24 @@ class Parser {
   std::string _error;
   std::string _regex;
   Encoding _encoding;
+  bool _ignorecase; // the operands of '&', '-' and '~' are folded before their product
+  Budget _budget; // for the sub-automata of '&', '-' and '~'
+  bool _estimating; // only bound the sub-automata, see DFA::estimate()
   const unsigned char* _regex_begin;
   const unsigned char* _regex_end;
   const unsigned char* _regex_ptr;
   std::deque<Expr> _expr_tree;
+  std::deque<Automaton> _automata;
+  std::deque<std::bitset<256> > _cc_tables;
+  std::set<const std::bitset<256>*, CCTableLess> _cc_index;
+  std::map<Shape, std::size_t> _shapes;
+  std::map<Shape, Expr*> _products;
+  std::size_t _reused;
   std::set<Expr*> _all_expr;
   Expr* _expr_root;
   std::bitset<256> _cc_table;
   unsigned char _literal;
+  unsigned int _codepoint;
   int _repeat_min, _repeat_max;
   bool _metachar;
   ExprType _token;
@@ -218,31 +492,28 @@ void Parser::Expr::init(ExprType t, Expr* lhs_ = NULL, Expr* rhs_ = NULL)
   type = t;
   lhs = lhs_;
   rhs = rhs_;
+  cc_table = NULL;
+  automaton = NULL;
+  shape = 0;
 
+  // first/last sets are not stored here: on a left-deep tree of n
+  // alternatives that would copy O(n^2) positions. see Parser::first().
   switch (type) {
-    case kLiteral: case kDot: case kCharClass: case kEOP: {
+    case kLiteral: case kDot: case kCharClass: case kEOP:
+    case kAutomaton: { // nullable is set by new_automaton()
       nullable = false;
-      first.insert(this);
-      last.insert(this);
       break;
     }
     case kUnion: {
       nullable = lhs->nullable || rhs->nullable;
-      set_union(lhs->first, rhs->first, first);
-      set_union(lhs->last, rhs->last, last);
       break;
     }
     case kConcat: {
       nullable = lhs->nullable && rhs->nullable;
-      if (lhs->nullable) set_union(lhs->first, rhs->first, first);
-      else first = lhs->first;
-      if (rhs->nullable) set_union(lhs->last, rhs->last, last);
-      else last = rhs->last;
       break;
     }
     case kStar: case kQmark: case kPlus: {
       nullable = (type == kPlus || type == kEOP) ? lhs->nullable : true;
-      first = lhs->first; last = lhs->last;
       break;
     }
     case kEpsilon: nullable = true; break;
@@ -267,20 +538,25 @@ void dump(const std::set<Parser::Expr*> &expr_set)
 void Parser::Expr::dump(std::size_t tab = 0)
 {
   static std::string tabs = "    ";
-  for (std::size_t i = 0; i < tab; i++) std::cout << tabs;
-  switch (type) {
-    case Parser::kUnion: case Parser::kConcat: {
-      std::cout << *this << std::endl;
-      lhs->dump(tab + 1);
-      rhs->dump(tab + 1);
-      break;
-    }
-    case Parser::kStar: case Parser::kPlus: case Parser::kQmark: {
-      std::cout << *this << std::endl;
-      lhs->dump(tab + 1);
-      break;
+  std::vector<std::pair<Expr*, std::size_t> > stack;
+  stack.push_back(std::make_pair(this, tab));
+
+  while (!stack.empty()) {
+    Expr* expr = stack.back().first;
+    std::size_t depth = stack.back().second;
+    stack.pop_back();
+
+    for (std::size_t i = 0; i < depth; i++) std::cout << tabs;
+    std::cout << *expr << std::endl;
+    switch (expr->type) {
+      case Parser::kUnion: case Parser::kConcat:
+        stack.push_back(std::make_pair(expr->rhs, depth + 1));
+        // fall through
+      case Parser::kStar: case Parser::kPlus: case Parser::kQmark:
+        stack.push_back(std::make_pair(expr->lhs, depth + 1));
+        break;
+      default: break;
     }
-    default: std::cout << *this << std::endl;
   }
 }
 
@@ -288,7 +564,7 @@ std::ostream& operator<<(std::ostream& stream, Parser::Expr& expr)
 {
   stream << expr.type_name() << ": " << "id = " << expr.id
          << ", nullable = " << expr.nullable << ", literal = "
-         << static_cast<int>(expr.literal) << ", #cc_table = " << expr.cc_table.count()
+         << static_cast<int>(expr.literal) << ", #cc_table = " << (expr.cc_table == NULL ? 0 : expr.cc_table->count())
          << ", follow = " << expr.follow.size();
   return stream;
 }
@@ -300,40 +576,152 @@ const char* Parser::Expr::type_name()
     "Concat", "Union", 
     "kStar", "kPlus", "kRepetition", "kQmark",
     "kEOP", "kLpar", "kRpar", "kByteRange", "kEpsilon",
+    "kIntersection", "kDifference", "kComplement", "kAutomaton",
     "kBadExpr"
   };
 
   return type_name_[type];
 }
 
+// the tree is checked against the Budget as it grows, so that repetitions
+// which clone a subexpression over and over fail early.
 Parser::Expr* Parser::new_expr(ExprType t = kEpsilon, Expr* lhs = NULL, Expr* rhs = NULL)
 {
+  if (_expr_tree.size() % 1024 == 0) _budget.check(0, _expr_tree.size() * sizeof(Expr));
   _expr_tree.resize(_expr_tree.size() + 1);
   _expr_tree.back().init(t, lhs, rhs);
   _expr_tree.back().id = _expr_tree.size() - 1;
   return &_expr_tree.back();
 }
 
+// the shared copy of a class table. tables are immutable once interned,
+// so clones and repeated classes point to the same one.
+const std::bitset<256>* Parser::intern(const std::bitset<256>& table)
+{
+  std::set<const std::bitset<256>*, CCTableLess>::iterator iter = _cc_index.find(&table);
+  if (iter != _cc_index.end()) return *iter;
+
+  _cc_tables.push_back(table);
+  _cc_index.insert(&_cc_tables.back());
+  return &_cc_tables.back();
+}
+
+// clone_expr() walks the tree in post-order with an explicit stack,
+// so cloning a huge (left-deep) subexpression can't overflow the call stack.
 Parser::Expr* Parser::clone_expr(Expr* orig)
 {
-  if (orig == NULL) return NULL;
+  std::vector<std::pair<Expr*, bool> > stack;
+  std::vector<Expr*> clones;
+  stack.push_back(std::make_pair(orig, false));
+
+  while (!stack.empty()) {
+    Expr* expr = stack.back().first;
+    bool visited = stack.back().second;
+    stack.pop_back();
+
+    if (expr == NULL) {
+      clones.push_back(NULL);
+    } else if (!visited) {
+      stack.push_back(std::make_pair(expr, true));
+      stack.push_back(std::make_pair(expr->rhs, false));
+      stack.push_back(std::make_pair(expr->lhs, false));
+    } else {
+      Expr* rhs = clones.back(); clones.pop_back();
+      Expr* lhs = clones.back(); clones.pop_back();
+      Expr* clone = new_expr(expr->type, lhs, rhs);
+      clone->shape = expr->shape;
+
+      switch (expr->type) {
+        case kLiteral:
+          clone->literal = expr->literal;
+          break;
+        case kCharClass:
+          clone->cc_table = expr->cc_table;
+          break;
+        case kAutomaton:
+          clone->automaton = clone_automaton(*expr->automaton);
+          clone->nullable = expr->nullable;
+          break;
+        default: break;
+      }
+      clones.push_back(clone);
+    }
+  }
+
+  return clones.back();
+}
+
+// first() and last() collect the positions (leaf expressions) which can
+// match the first/last character of the given expression. they are computed
+// on demand and only descend into a concatenation's other operand when the
+// nearer one is nullable, so each query touches little more than its result.
+std::set<Parser::Expr*>& Parser::first(Expr* expr, std::set<Expr*>& dst)
+{
+  std::vector<Expr*> stack(1, expr);
 
-  Expr* clone = new_expr(orig->type, clone_expr(orig->lhs), clone_expr(orig->rhs));
+  while (!stack.empty()) {
+    Expr* e = stack.back();
+    stack.pop_back();
 
-  switch (orig->type) {
-    case kLiteral:
-      clone->literal = orig->literal;
-      break;
-    case kCharClass:
-      clone->cc_table = orig->cc_table;
-      break;
-    default: break;
+    switch (e->type) {
+      case kLiteral: case kDot: case kCharClass: case kEOP:
+        dst.insert(e);
+        break;
+      case kAutomaton:
+        dst.insert(e->automaton->first.begin(), e->automaton->first.end());
+        break;
+      case kConcat:
+        if (e->lhs->nullable) stack.push_back(e->rhs);
+        stack.push_back(e->lhs);
+        break;
+      case kUnion:
+        stack.push_back(e->rhs);
+        // fall through
+      case kStar: case kPlus: case kQmark:
+        stack.push_back(e->lhs);
+        break;
+      default: break;
+    }
+  }
+
+  return dst;
+}
+
+std::set<Parser::Expr*>& Parser::last(Expr* expr, std::set<Expr*>& dst)
+{
+  std::vector<Expr*> stack(1, expr);
+
+  while (!stack.empty()) {
+    Expr* e = stack.back();
+    stack.pop_back();
+
+    switch (e->type) {
+      case kLiteral: case kDot: case kCharClass: case kEOP:
+        dst.insert(e);
+        break;
+      case kAutomaton:
+        dst.insert(e->automaton->last.begin(), e->automaton->last.end());
+        break;
+      case kConcat:
+        if (e->rhs->nullable) stack.push_back(e->lhs);
+        stack.push_back(e->rhs);
+        break;
+      case kUnion:
+        stack.push_back(e->rhs);
+        // fall through
+      case kStar: case kPlus: case kQmark:
+        stack.push_back(e->lhs);
+        break;
+      default: break;
+    }
   }
 
-  return clone;
+  return dst;
 }
 
-Parser::Parser(const std::string& regex, Encoding enc): _ok(true), _regex(regex), _encoding(enc), _metachar(false)
+Parser::Parser(const std::string& regex, Encoding enc, bool ignorecase, const Budget& budget, bool estimating):
+    _ok(true), _regex(regex), _encoding(enc), _ignorecase(ignorecase), _budget(budget),
+    _estimating(estimating), _reused(0), _metachar(false)
 {
   _regex_begin = _regex_ptr = reinterpret_cast<const unsigned char*>(_regex.data());
   _regex_end = reinterpret_cast<const unsigned char*>(_regex.data()) + _regex.length();
@@ -364,12 +752,17 @@ Parser::ExprType Parser::consume()
     case '*': _token = kStar;  break;
     case '(': _token = kLpar;  break;
     case ')': _token = kRpar;  break;
+    case '&': _token = kIntersection; break;
+    case '-': _token = kDifference;   break;
+    case '~': _token = kComplement;   break;
     case '{': consume_char(); _token = consume_repetition(); break;
     case '\\':consume_char(); meta = true; _token = consume_metachar(); break;
     default:
       if (_encoding == UTF8 && utf8_byte_length(_literal) != 1) {
         if (!is_valid_utf8_sequence(_regex_ptr)) throw "invalid utf8 sequence";
         _token = kUTF8;
+        _codepoint = utf8_decode(_regex_ptr);
+        _regex_ptr += utf8_byte_length(_literal);
         metachar(false);
         return _token;
       } else {
@@ -517,6 +910,26 @@ Parser::ExprType Parser::consume_metachar()
       token = kByteRange;
       break;
     case 'x': {
+      if (*(_regex_ptr+1) == '{') {
+        // \x{HHHH}: a codepoint (utf8), or a byte.
+        unsigned int codepoint = 0;
+        consume_char();
+        while (isxdigit(consume_char()) && codepoint <= kMaxCodepoint) {
+          codepoint <<= 4;
+          codepoint += isdigit(lex_char()) ? lex_char() - '0' : tolower(lex_char()) - 'a' + 10;
+        }
+        if (lex_char() != '}' || *(_regex_ptr-1) == '{') throw "bad '\\x{...}'";
+        if (codepoint < 0x80 || (_encoding != UTF8 && codepoint < 0x100)) {
+          _literal = codepoint;
+          token = kLiteral;
+        } else if (_encoding == UTF8 && codepoint <= kMaxCodepoint) {
+          _codepoint = codepoint;
+          token = kUTF8;
+        } else {
+          throw "bad '\\x{...}'";
+        }
+        break;
+      }
       unsigned char hex = 0;
       for (int i = 0; i < 2; i++) {
         _literal = consume_char();
@@ -563,40 +976,84 @@ void Parser::parse()
     _expr_root = new_expr(kConcat, expr, eop);
   }
 
-  fill_transition(_expr_root);
+  fill_transition(_expr_root, _all_expr);
 }
 
+// parse_union() parses "union ::= product ('|' product)*" iteratively.
+// instead of recursing through parse_atom() on every '(', open groups are
+// kept on an explicit stack, so nesting depth is bounded only by memory.
 Parser::Expr* Parser::parse_union()
 {
-  Expr* e = parse_concat();
+  std::vector<Group> groups(1);
 
-  while (lex() == kUnion) {
-    consume();
-    Expr* f = parse_concat();
-    Expr* g = new_expr(kUnion, e, f);
-    e = g;
+  for (;;) {
+    Expr* e;
+
+    if (lex() == kLpar) {
+      groups.push_back(Group(_regex_ptr - 1));
+      consume();
+      continue;
+    } else if (lex() == kComplement) {
+      groups.back().complements++;
+      consume();
+      continue;
+    } else if (groups.back().concatenation == NULL && !lex_is_atom() &&
+               (lex() == kIntersection || lex() == kDifference ||
+                groups.back().operand != NULL || groups.back().complements > 0)) {
+      throw "missing operand of '&', '-' or '~'";
+    } else if (groups.back().concatenation == NULL || lex_is_atom()) {
+      e = parse_atom();
+    } else if (groups.back().complements > 0) {
+      throw "bad '~'";
+    } else if (lex() == kIntersection || lex() == kDifference) {
+      Group& g = groups.back();
+      g.operand = close_product(g);
+      g.op = lex();
+      g.concatenation = NULL;
+      consume();
+      continue;
+    } else if (lex() == kUnion) {
+      Group& g = groups.back();
+      Expr* f = close_product(g);
+      g.alternation = g.alternation == NULL ? f : new_expr(kUnion, g.alternation, f);
+      g.concatenation = NULL;
+      consume();
+      continue;
+    } else if (groups.size() > 1) {
+      if (lex() != kRpar) throw "bad parentheses";
+      Group& g = groups.back();
+      Expr* f = close_product(g);
+      e = g.alternation == NULL ? f : new_expr(kUnion, g.alternation, f);
+      groups.pop_back();
+      consume();
+    } else {
+      break;
+    }
+
+    e = parse_repetition(e);
+    Group& g = groups.back();
+    if (g.complements % 2 == 1) e = new_automaton(kComplement, e, NULL);
+    g.complements = 0;
+    g.concatenation = g.concatenation == NULL ? e :
+        new_expr(kConcat, g.concatenation, e);
   }
 
-  return e;
+  Group& g = groups.back();
+  Expr* f = close_product(g);
+  return g.alternation == NULL ? f : new_expr(kUnion, g.alternation, f);
 }
 
-Parser::Expr* Parser::parse_concat()
+// the current concatenation, combined with a pending '&' or '-' operand.
+Parser::Expr* Parser::close_product(Group& g)
 {
-  Expr* e = parse_repetition();
-
-  while (lex_is_atom()) {
-    Expr* f = parse_repetition();
-    Expr* g = new_expr(kConcat, e, f);
-    e = g;
-  }
-
+  Expr* e = g.operand == NULL ? g.concatenation :
+      new_automaton(g.op, g.operand, g.concatenation);
+  g.operand = NULL;
   return e;
 }
 
-Parser::Expr* Parser::parse_repetition()
+Parser::Expr* Parser::parse_repetition(Expr* e)
 {
-  Expr* e = parse_atom();
-
   while (lex_is_quantifier()) {
     switch (lex()) {
       case kStar: case kPlus: case kQmark: {
@@ -659,7 +1116,7 @@ Parser::Expr* Parser::parse_atom()
     }
     case kByteRange: {
       e = new_expr(kCharClass);
-      e->cc_table = _cc_table;
+      e->cc_table = intern(_cc_table);
       break;
     }
     case kEpsilon: {
@@ -667,22 +1124,16 @@ Parser::Expr* Parser::parse_atom()
       break;
     }
     case kUTF8: {
-      unsigned char top = _literal;
+      unsigned char bytes[4];
+      std::size_t len = utf8_encode(_codepoint, bytes);
       e = new_expr(kLiteral);
-      e->literal = top;
-      for (std::size_t i = 1; i < utf8_byte_length(top); i++) {
+      e->literal = bytes[0];
+      for (std::size_t i = 1; i < len; i++) {
         Expr* f = new_expr(kLiteral);
-        f->literal = consume_char();
+        f->literal = bytes[i];
         Expr* g = new_expr(kConcat, e, f);
         e = g;
       }
-      consume_char();
-      break;
-    }
-    case kLpar: {
-      consume();
-      e = parse_union();
-      if (lex() != kRpar) throw "bad parentheses";
       break;
     }
     default: throw "can't handle the type ";
@@ -695,7 +1146,10 @@ Parser::Expr* Parser::parse_atom()
 
 Parser::Expr* Parser::parse_charclass()
 {
+  if (_encoding == UTF8) return parse_utf8_charclass();
+
   Expr* cc = new_expr(kCharClass);
+  std::bitset<256> table;
   bool range = false;
   bool negative = false;
   unsigned char last = '\0';
@@ -708,7 +1162,7 @@ Parser::Expr* Parser::parse_charclass()
   }
   if (_literal == '-' ||
       _literal == ']') {
-    cc->cc_table.set(_literal);
+    table.set(_literal);
     last = _literal;
     consume();
   }
@@ -719,11 +1173,11 @@ Parser::Expr* Parser::parse_charclass()
       continue;
     }
 
-    if (lex() == kByteRange) cc->cc_table |= _cc_table;
-    else cc->cc_table.set(_literal);
+    if (lex() == kByteRange) table |= _cc_table;
+    else table.set(_literal);
 
     if (range) {
-      for (std::size_t c = last; c <= _literal; c++) cc->cc_table.set(c);
+      for (std::size_t c = last; c <= _literal; c++) table.set(c);
       range = false;
     }
 
@@ -731,938 +1185,4284 @@ Parser::Expr* Parser::parse_charclass()
   }
 
   if (lex() == kEOP) throw "invalid character class";
-  if (range) cc->cc_table.set('-');
-  if (negative) cc->cc_table.flip();
-  if (cc->cc_table.count() == 1) {
+  if (range) table.set('-');
+  if (negative) table.flip();
+  if (table.count() == 1) {
     cc->type = kLiteral;
     for (std::size_t c = 0; c < 256; c++) {
-      if (cc->cc_table[c]) {
+      if (table[c]) {
         cc->literal = c;
         break;
       }
     }
-    cc->cc_table.reset();
+  } else {
+    cc->cc_table = intern(table);
   }
 
   return cc;
 }
 
-void Parser::fill_transition(Expr *expr)
+// with --utf8, a character class is a set of codepoints. it is compiled into
+// a byte-level sub-automaton: each codepoint range is split into sequences of
+// byte ranges (see split_utf8_range), and sequences are merged on their
+// common prefixes, so e.g. [\x{80}-\x{10ffff}] needs only 9 byte ranges
+// instead of a union of a million literal chains.
+Parser::Expr* Parser::parse_utf8_charclass()
 {
-  switch (expr->type) {
-    case kLiteral: case kCharClass: case kDot: case kEOP:
-      _all_expr.insert(expr);
-      break;
-    case kEpsilon:
-      break;
-    case kConcat:
-      connect(expr->lhs->last, expr->rhs->first);
-      // fall through
-    case kUnion:
-      fill_transition(expr->lhs); fill_transition(expr->rhs);
-      break;
-    case kStar: case kPlus:
-      connect(expr->lhs->last, expr->lhs->first);
-      // fall through
-    case kQmark:
-      fill_transition(expr->lhs);
-      break;
-    default: throw "can't handle the type";
+  CodepointRanges ranges;
+  bool range = false;
+  bool negative = false;
+  unsigned int last = '\0';
+
+  consume();
+
+  if (_literal == '^' && !metachar()) {
+    consume();
+    negative = true;
+  }
+  if (lex() != kUTF8 && (_literal == '-' || _literal == ']')) {
+    ranges.push_back(std::make_pair(_literal, _literal));
+    last = _literal;
+    consume();
+  }
+
+  for (; lex() != kEOP && (lex() == kUTF8 || _literal != ']'); consume()) {
+    if (!range && lex() != kUTF8 && _literal == '-' && !metachar()) {
+      range = true;
+      continue;
+    }
+
+    unsigned int codepoint = lex() == kUTF8 ? _codepoint : _literal;
+    if (lex() == kByteRange) {
+      for (unsigned int c = 0; c < 0x80; c++) {
+        if (_cc_table[c]) ranges.push_back(std::make_pair(c, c));
+      }
+      // negated classes (\D, \S, \W) contain every non-ASCII codepoint.
+      if (_cc_table[0x80]) ranges.push_back(std::make_pair(0x80u, kMaxCodepoint));
+    } else {
+      ranges.push_back(std::make_pair(codepoint, codepoint));
+    }
+
+    if (range) {
+      if (last <= codepoint) ranges.push_back(std::make_pair(last, codepoint));
+      range = false;
+    }
+
+    last = codepoint;
+  }
+
+  if (lex() == kEOP) throw "invalid character class";
+  if (range) ranges.push_back(std::make_pair('-', '-'));
+  normalize_codepoint_ranges(ranges, negative);
+
+  std::vector<ByteRanges> sequences;
+  for (std::size_t i = 0; i < ranges.size(); i++) {
+    split_utf8_range(ranges[i].first, ranges[i].second, sequences);
   }
+  if (sequences.empty()) return new_expr(kCharClass); // matches nothing
+  std::sort(sequences.begin(), sequences.end());
+
+  return new_byte_sequences(sequences, 0, sequences.size(), 0);
 }
 
-void Parser::connect(std::set<Expr*> src, std::set<Expr*> dst)
+Parser::Expr* Parser::new_byte_range(unsigned char lo, unsigned char hi)
 {
-  for (std::set<Expr*>::iterator iter = src.begin(); iter != src.end(); ++iter) {
-    (*iter)->follow.insert(dst.begin(), dst.end());
+  Expr* e;
+  if (lo == hi) {
+    e = new_expr(kLiteral);
+    e->literal = lo;
+  } else {
+    std::bitset<256> table;
+    for (std::size_t c = lo; c <= hi; c++) table.set(c);
+    e = new_expr(kCharClass);
+    e->cc_table = intern(table);
   }
+  return e;
 }
 
-class DFA {
- public:
-  enum State_t { REJECT = -1, START = 0 };
-  typedef std::set<Parser::Expr*> Subset;
-  struct State {
-    int t[256];
-    int id;
-    bool accept;
-    int operator[](std::size_t i) const { return t[i]; }
-    int& operator[](std::size_t i) { return t[i]; }
-  };
-  DFA(const std::string&, Encoding, bool, bool, bool);
-  bool ok() const { return _ok; }
-  bool factorial() const { return _factorial; }
-  bool ignorecase() const { return _ignorecase; }
-  const std::string& error() const { return _error; }
-  std::size_t size() const { return _states.size(); }
-  const State& state(std::size_t i) const { return _states[i]; }
-  State& state(std::size_t i) { return _states[i]; }
-  bool accept(int state) const { return state != REJECT && _states[state].accept; }
-  bool accept(const std::string&) const;
-  const State& operator[](std::size_t i) const { return _states[i]; }
-  State& operator[](std::size_t i) { return _states[i]; }
-  void minimize();
-  bool operator==(const DFA&) const;
-  friend std::ostream& operator<<(std::ostream& stream, const DFA& dfa);
- private:
-  void construct(Parser::Expr* expr, const Subset& all_expr);
-  void fill_transition(Parser::Expr*, std::vector<Subset>&);
-  State& new_state();
-  static std::string& pretty(unsigned char, std::string &);
-
-  //fields
-  bool _ok;
-  bool _factorial;
-  bool _ignorecase;
-  std::string _error;
-  std::deque<State> _states;
-};
-
-bool DFA::operator==(const DFA& lhs) const
+// build the union of the (sorted) byte range sequences [begin, end), as
+// a tree which shares their common prefixes from the given depth on.
+// sequences are at most 4 ranges long, so is the recursion.
+Parser::Expr* Parser::new_byte_sequences(const std::vector<ByteRanges>& sequences,
+                                         std::size_t begin, std::size_t end, std::size_t depth)
 {
-  if (state(START).accept != lhs.state(START).accept) return false;
-  
-  std::set<std::pair<int, int> > equivalent_states;
-  equivalent_states.insert(std::pair<int, int>(REJECT, REJECT));
-  equivalent_states.insert(std::pair<int, int>(START, START));
-  std::queue<std::pair<int, int> > queue;
-  queue.push(std::pair<int, int>(START, START));
+  Expr* e = NULL;
 
-  while (!queue.empty()) {
-    std::pair<int, int> pair = queue.front();
-    queue.pop();
+  while (begin < end) {
+    std::size_t next = begin + 1;
+    while (next < end && sequences[next][depth] == sequences[begin][depth]) next++;
 
-    const State& s1 = state(pair.first);
-    const State& s2 = lhs.state(pair.second);
-    if (s1.accept != s2.accept) return false;
+    Expr* f = new_byte_range(sequences[begin][depth].first, sequences[begin][depth].second);
+    if (depth + 1 < sequences[begin].size()) {
+      f = new_expr(kConcat, f, new_byte_sequences(sequences, begin, next, depth + 1));
+    }
+    e = e == NULL ? f : new_expr(kUnion, e, f);
+    begin = next;
+  }
 
-    for (std::size_t c = 0; c < 256; c++) {
-      std::pair<int, int> next(s1[c], s2[c]);
+  return e;
+}
 
-      if (equivalent_states.find(next) == equivalent_states.end()) {
-        if (next.first == REJECT || next.second == REJECT) return false;
+void Parser::fill_transition(Expr *root, std::set<Expr*>& positions)
+{
+  std::vector<Expr*> stack(1, root);
 
-        equivalent_states.insert(next);
-        queue.push(next);
-      }
+  while (!stack.empty()) {
+    Expr* expr = stack.back();
+    std::set<Expr*> src, dst;
+    stack.pop_back();
+
+    switch (expr->type) {
+      case kLiteral: case kCharClass: case kDot: case kEOP:
+        positions.insert(expr);
+        break;
+      case kAutomaton:
+        positions.insert(expr->automaton->positions.begin(), expr->automaton->positions.end());
+        break;
+      case kEpsilon:
+        break;
+      case kConcat:
+        connect(last(expr->lhs, src), first(expr->rhs, dst));
+        // fall through
+      case kUnion:
+        stack.push_back(expr->rhs); stack.push_back(expr->lhs);
+        break;
+      case kStar: case kPlus:
+        connect(last(expr->lhs, src), first(expr->lhs, dst));
+        // fall through
+      case kQmark:
+        stack.push_back(expr->lhs);
+        break;
+      default: throw "can't handle the type";
     }
   }
-  
-  return true;
 }
 
-std::ostream& operator<<(std::ostream& stream, const DFA& dfa)
+// estimate() bounds the number of states of the (unminimized) DFA from the
+// positions and their follow sets, before any subset is built. a state is
+// the first set, or for some byte c, the union of the follow sets of its
+// positions which match c: so at most 1 + sum_c (2^f(c) - 1) states, where
+// f(c) is the number of distinct follow sets of the positions matching c.
+// if no first/follow set holds two positions sharing a byte (a deterministic
+// regex), every state is the first set or a single follow set.
+// a product which was only estimated (see new_automaton()) stands in the
+// tree as one position, and multiplies the bound by its own. that is an
+// estimate rather than a bound if a repetition can enter the product again
+// before it has left it.
+std::size_t Parser::estimate(bool factorial, bool ignorecase) const
 {
-  static const char* const state_circle = "circle";
-  static const char* const accept_circle = "doublecircle";
-  static const char* const style  = "fillcolor=lightsteelblue1, style=filled, color = navyblue ";
+  std::size_t estimate_ = estimate(_expr_root, _all_expr, factorial, ignorecase);
+  for (std::size_t i = 0; i < _automata.size(); i++) {
+    if (_automata[i].bound == 0) continue;
+    if (estimate_ > static_cast<std::size_t>(-1) / _automata[i].bound) return static_cast<std::size_t>(-1);
+    estimate_ *= _automata[i].bound;
+  }
+  return estimate_;
+}
 
-  stream << "digraph DFA {\n  rankdir=\"LR\"" << std::endl;
-  for (std::size_t i = 0; i < dfa.size(); i++) {
-    stream << "  " << i << " [shape= " << (dfa[i].accept ? accept_circle : state_circle)
-           << ", " << style << "]" << std::endl;
+std::size_t Parser::estimate(Expr* root, const std::set<Expr*>& all_expr, bool factorial, bool ignorecase)
+{
+  // ids of the distinct first/follow sets (the first set is 0).
+  std::map<std::set<Expr*>, std::size_t> follow_ids;
+  std::vector<std::pair<std::bitset<256>, std::size_t> > positions;
+  std::set<Expr*> first_set;
+  follow_ids[first(root, first_set)] = 0;
+  for (std::set<Expr*>::const_iterator iter = all_expr.begin(); iter != all_expr.end(); ++iter) {
+    std::bitset<256> bytes_ = bytes(*iter, ignorecase);
+    if (bytes_.none()) continue; // kEOP
+    std::size_t id = follow_ids.insert(std::make_pair((*iter)->follow, follow_ids.size())).first->second;
+    positions.push_back(std::make_pair(bytes_, id));
   }
-  stream << "  start [shape=point]\n  start -> " << DFA::START << std::endl;
 
-  std::string label;
-  for (std::size_t i = 0; i < dfa.size(); i++) {
-    bool range = false; unsigned char last;
-    for (unsigned int c = 0; c < 256; c++) {
-      if (dfa[i][c] != DFA::REJECT) {
-        if (range && !(c + 1 < 256 && dfa[i][c] == dfa[i][c+1])) {
-          stream << DFA::pretty(c, label) << "]\"]" << std::endl;
-          range = false;
-        } else if (c + 1 < 256 && dfa[i][c] == dfa[i][c+1]) {
-          if (range) continue;
-          range = true;
-          last = c;
-          stream << "  " << i << " -> " << dfa[i][c]
-                 << " [label=\"[" << DFA::pretty(c, label) << "-";
-        } else {
-          stream << "  " << i << " -> " << dfa[i][c]
-                 << " [label=\"" << DFA::pretty(c, label) << "\"]" << std::endl;
-        }
+  std::vector<const std::set<Expr*>*> sets;
+  for (std::map<std::set<Expr*>, std::size_t>::const_iterator iter = follow_ids.begin();
+       iter != follow_ids.end(); ++iter) {
+    sets.push_back(&iter->first);
+  }
+
+  bool deterministic = !factorial;
+  for (std::size_t i = 0; deterministic && i < sets.size(); i++) {
+    std::bitset<256> seen;
+    for (std::set<Expr*>::const_iterator iter = sets[i]->begin(); iter != sets[i]->end(); ++iter) {
+      std::bitset<256> bytes_ = bytes(*iter, ignorecase);
+      if ((seen & bytes_).any()) deterministic = false;
+      seen |= bytes_;
+    }
+  }
+  if (deterministic) return follow_ids.size();
+
+  std::size_t estimate = 1;
+  std::vector<bool> found(follow_ids.size());
+  for (std::size_t c = 0; c < 256; c++) {
+    std::size_t distinct = 0;
+    std::fill(found.begin(), found.end(), false);
+    for (std::size_t i = 0; i < positions.size(); i++) {
+      if (positions[i].first[c] && !found[positions[i].second]) {
+        found[positions[i].second] = true;
+        distinct++;
       }
     }
+    if (distinct >= sizeof(std::size_t) * 8 - 1) return static_cast<std::size_t>(-1);
+    std::size_t states = (static_cast<std::size_t>(1) << distinct) - 1;
+    if (estimate + states < estimate) return static_cast<std::size_t>(-1);
+    estimate += states;
   }
-  stream << "}" << std::endl;
-  
-  return stream;
+
+  return estimate;
 }
 
-std::string& rans::DFA::pretty(unsigned char c, std::string &label)
+// the bytes which a position matches.
+std::bitset<256> Parser::bytes(const Expr* e, bool ignorecase)
 {
-  std::stringstream label_;
-  if (' ' <= c && c <= '~') {
-    if (c == '"' || c == '\\') label_ << '\\';
-    label_ << c;
-  } else {
-    label_ << std::showbase << std::hex << static_cast<unsigned int>(c);
-  }
+  std::bitset<256> bytes_;
+  if (e->type == kLiteral) bytes_.set(e->literal);
+  else if (e->type == kCharClass) bytes_ = *e->cc_table;
+  else if (e->type == kDot) bytes_.set();
 
-  label_ >> label;
-  return label;
+  if (ignorecase) {
+    for (std::size_t c = 0; c < 256; c++) {
+      if (bytes_[c]) bytes_.set(opposite_case(c));
+    }
+  }
+  return bytes_;
 }
 
-DFA::DFA(const std::string &regex, Encoding enc = ASCII, bool minimizing = true, bool factorial = false, bool ignorecase = false): _ok(true), _factorial(factorial), _ignorecase(ignorecase)
+void Parser::connect(const std::set<Expr*>& src, const std::set<Expr*>& dst)
 {
-  Parser p(regex, enc);
-  if (!p.ok()) {
-    _ok = false;
-    _error = p.error();
-    return;
+  for (std::set<Expr*>::const_iterator iter = src.begin(); iter != src.end(); ++iter) {
+    (*iter)->follow.insert(dst.begin(), dst.end());
   }
+}
 
-  try {
-    construct(p.expr_tree(), p.all_expr());
-  } catch (const char* error) {
-    _ok = false;
-    _error = "dfa construct error: ";
-    _error += error;
-    return;
-   }
+// rans::DAWG is the minimal acyclic DFA (Directed Acyclic Word Graph) of a
+// finite set of words. it is built incrementally from lexicographically
+// sorted words: whenever a word leaves the path of its predecessor, the
+// finished branch is merged into an equivalent registered node at once
+// (Daciuk et al., "Incremental Construction of Minimal Acyclic Finite-State
+// Automata", 2000), so memory stays proportional to the minimal automaton
+// instead of to the trie of all words.
+//
+// once finished, words can also be inserted and erased in any order, keeping
+// the graph minimal (Carrasco and Forcada, "Incremental Construction and
+// Maintenance of Minimal Finite-State Automata", 2002).
+class DAWG {
+ public:
+  enum Node_t { ROOT = 0 };
+  typedef std::vector<std::pair<unsigned char, int> > Edges;
+  struct Node {
+    Node(): accept(false), indegree(0) {}
+    bool accept;
+    std::size_t indegree;
+    Edges edges; // sorted by label
+  };
+  DAWG(): _nodes(1), _register(NodeLess(this)) {}
+  DAWG(const std::vector<std::string>&);
+  void append(const std::string&);
+  void finish() { replace_or_register(ROOT); }
+  bool insert(const std::string&);
+  bool erase(const std::string&);
+  bool accept(const std::string&) const;
+  int next(int, unsigned char) const;
+  std::size_t capacity() const { return _nodes.size(); }
+  std::size_t size() const { return _nodes.size() - _free.size(); }
+  const Node& node(std::size_t i) const { return _nodes[i]; }
+ private:
+  //DISALLOW COPY AND ASSIGN
+  DAWG(const DAWG&);
+  void operator=(const DAWG&);
+  struct NodeLess {
+    NodeLess(const DAWG* dawg): _dawg(dawg) {}
+    bool operator()(int, int) const;
+    const DAWG* _dawg;
+  };
+  int new_node();
+  void delete_node(int);
+  Edges::iterator edge(int, unsigned char);
+  void replace_or_register(int);
+  void unshare(const std::string&, std::vector<int>&);
+  void reregister(const std::string&, std::vector<int>&);
 
-  try {
-    if (minimizing) minimize();
-  } catch (const char* error) {
-    _ok = false;
-    _error = "dfa minimize error: ";
-    _error += error;
-  }
+  // fields
+  std::vector<Node> _nodes;
+  std::vector<int> _free;
+  std::set<int, NodeLess> _register;
+};
+
+bool DAWG::NodeLess::operator()(int lhs, int rhs) const
+{
+  const Node& n1 = _dawg->_nodes[lhs];
+  const Node& n2 = _dawg->_nodes[rhs];
+  if (n1.accept != n2.accept) return n1.accept < n2.accept;
+  return n1.edges < n2.edges;
 }
 
-void DFA::construct(Parser::Expr* expr_tree, const Subset& all_expr)
+// words may be given in any order: unsorted input is sorted (on a copy)
+// first, and duplicates are ignored.
+DAWG::DAWG(const std::vector<std::string>& words): _nodes(1), _register(NodeLess(this))
 {
-  int state_num = 0;
-  std::vector<Subset> transition(256);
-  std::queue<Subset> queue;
-  std::map<Subset, int> subset_to_state;
-  if (_factorial) {
-    queue.push(all_expr);
-    subset_to_state[all_expr] = state_num++;
-  } else {
-    queue.push(expr_tree->first);
-    subset_to_state[expr_tree->first] = state_num++;
+  std::vector<std::string> sorted;
+  const std::vector<std::string>* list = &words;
+  if (std::adjacent_find(words.begin(), words.end(),
+                         std::greater<std::string>()) != words.end()) {
+    sorted = words;
+    std::sort(sorted.begin(), sorted.end());
+    list = &sorted;
   }
 
-  while (!queue.empty()) {
-    bool accept = false;
-    Subset &subset = queue.front();
-    std::fill(transition.begin(), transition.end(), Subset());
-
-    for (Subset::iterator iter = subset.begin(); iter != subset.end(); ++iter) {
-      accept |= _factorial | ((*iter)->type == Parser::kEOP);
-      fill_transition(*iter, transition);
-    }
-    queue.pop();
-
-    State& state = new_state();
-    state.accept = accept;
+  for (std::size_t i = 0; i < list->size(); i++) append((*list)[i]);
+  finish();
+}
 
-    for (std::size_t c = 0; c < 256; c++) {
-      Subset& next = transition[c];
+int DAWG::new_node()
+{
+  if (_free.empty()) {
+    _nodes.resize(_nodes.size() + 1);
+    return _nodes.size() - 1;
+  }
 
-      if (next.empty()) continue;
+  int n = _free.back();
+  _free.pop_back();
+  _nodes[n] = Node();
+  return n;
+}
 
-      if (subset_to_state.find(next) == subset_to_state.end()) {
-        subset_to_state[next] = state_num++;
-        queue.push(next);
-      }
+void DAWG::append(const std::string& word)
+{
+  int state = ROOT;
+  std::size_t i = 0;
+
+  // walk along the common prefix with the previously appended word.
+  for (; i < word.length(); i++) {
+    const Edges& edges = _nodes[state].edges;
+    if (edges.empty() || edges.back().first != static_cast<unsigned char>(word[i])) break;
+    state = edges.back().second;
+  }
 
-      state[c] = subset_to_state[next];
+  if (i < word.length() && !_nodes[state].edges.empty()) {
+    if (_nodes[state].edges.back().first > static_cast<unsigned char>(word[i])) {
+      throw "words are not sorted";
     }
+    replace_or_register(state);
   }
+
+  for (; i < word.length(); i++) {
+    int next = new_node();
+    _nodes[next].indegree = 1;
+    _nodes[state].edges.push_back(std::make_pair(static_cast<unsigned char>(word[i]), next));
+    state = next;
+  }
+  _nodes[state].accept = true;
 }
 
-void DFA::fill_transition(Parser::Expr* expr, std::vector<DFA::Subset>& transition)
+// free a node which is no longer referenced. nodes which lose their last
+// reference because of it are released too.
+void DAWG::delete_node(int node)
 {
-  switch (expr->type) {
-    case Parser::kLiteral: {
-      unsigned char index = expr->literal;
-      transition[index].insert(expr->follow.begin(), expr->follow.end());
-      if (ignorecase()) {
-        unsigned char index_ = opposite_case(index);
-        if (index_ != index) transition[index_].insert(expr->follow.begin(), expr->follow.end());
-      }
-      break;
-    }
-    case Parser::kCharClass: {
-      for (std::size_t c = 0; c < 256; c++) {
-        if (expr->cc_table[c]) {
-          transition[c].insert(expr->follow.begin(), expr->follow.end());
-          if (ignorecase()) {
-            unsigned char c_ = opposite_case(static_cast<unsigned char>(c));
-            if (c_ != c && !expr->cc_table[c_]) transition[c_].insert(expr->follow.begin(), expr->follow.end());
-          }
-        }
-      }
-      break;
-    }
-    case Parser::kDot: {
-      for (std::size_t c = 0; c < 256; c++) {
-        transition[c].insert(expr->follow.begin(), expr->follow.end());
+  std::vector<int> stack(1, node);
+
+  while (!stack.empty()) {
+    int n = stack.back();
+    stack.pop_back();
+
+    for (std::size_t i = 0; i < _nodes[n].edges.size(); i++) {
+      int target = _nodes[n].edges[i].second;
+      if (--_nodes[target].indegree == 0) {
+        std::set<int, NodeLess>::iterator iter = _register.find(target);
+        if (iter != _register.end() && *iter == target) _register.erase(iter);
+        stack.push_back(target);
       }
-      break;
     }
-    case Parser::kEOP: break;
-    default: throw "can't handle the type";
+    _nodes[n] = Node();
+    _free.push_back(n);
   }
 }
 
-DFA::State& DFA::new_state()
+DAWG::Edges::iterator DAWG::edge(int node, unsigned char c)
 {
-  _states.resize(_states.size() + 1);
-  State& state = _states.back();
-  std::fill(state.t, state.t+256, REJECT);
-  state.id = _states.size() - 1;
-  return state;
+  Edges& edges = _nodes[node].edges;
+  Edges::iterator iter = std::lower_bound(edges.begin(), edges.end(), std::make_pair(c, INT_MIN));
+  return (iter != edges.end() && iter->first == c) ? iter : edges.end();
 }
 
-void DFA::minimize()
+int DAWG::next(int node, unsigned char c) const
 {
-  std::vector<std::vector<bool> > distinction_table;
-  distinction_table.resize(size()-1);
-  for (std::size_t i = 0; i < size()-1; i++) {
-    distinction_table[i].resize(size()-i-1);
-    for (std::size_t j = i+1; j < size(); j++) {
-      distinction_table[i][size()-j-1] = _states[i].accept != _states[j].accept;
-    }
-  }
-
-  bool distinction_flag = true;
-  while (distinction_flag) {
-    distinction_flag = false;
-    for (std::size_t i = 0; i < size()-1; i++) {
-      for (std::size_t j = i+1; j < size(); j++) {
-        if (!distinction_table[i][size()-j-1]) {
-          for (std::size_t input = 0; input < 256; input++) {
-            int n1, n2;
-            n1 = _states[i][input];
-            n2 = _states[j][input];
-            if (n1 != n2) {
-              if (n1 > n2) std::swap(n1, n2);
-              if ((n1 == REJECT || n2 == REJECT) ||
-                  distinction_table[n1][size()-n2-1]) {
-                distinction_flag = true;
-                distinction_table[i][size()-j-1] = true;
-                break;
-              }
-            }
-          }
-        }
-      }
-    }
-  }
+  const Edges& edges = _nodes[node].edges;
+  Edges::const_iterator iter = std::lower_bound(edges.begin(), edges.end(), std::make_pair(c, INT_MIN));
+  return (iter != edges.end() && iter->first == c) ? iter->second : -1;
+}
 
-  std::map<int, int> swap_map;
-  for (std::size_t i = 0; i < size()-1; i++) {
-    for (std::size_t j = i+1; j < size(); j++) {
-      if (swap_map.find(j) == swap_map.end()) {
-        if (!distinction_table[i][size()-j-1]) {
-          swap_map[j] = i;
-        }
-      }
-    }
+bool DAWG::accept(const std::string& word) const
+{
+  int node = ROOT;
+  for (std::size_t i = 0; node != -1 && i < word.length(); i++) {
+    node = next(node, static_cast<unsigned char>(word[i]));
   }
 
-  if (swap_map.empty()) return;
+  return node != -1 && _nodes[node].accept;
+}
 
-  std::size_t minimum_size = size() - swap_map.size();
-  std::vector<std::size_t> replace_map(size());
-  for (std::size_t s = 0, d = 0; s < size(); s++) {
-    if (swap_map.find(s) == swap_map.end()) {
-      replace_map[s] = d++;
-      if (s != replace_map[s]) {
-        _states[replace_map[s]] = _states[s];
-        _states[replace_map[s]].id = replace_map[s];
+// follow the longest prefix of the word and make every node on that path
+// private to it, so that it can be modified: nodes before the first
+// confluence (indegree > 1) are taken out of the register, the confluence
+// node and everything after it are cloned.
+// path[i] is the node reached by word[0, i).
+void DAWG::unshare(const std::string& word, std::vector<int>& path)
+{
+  bool cloning = false;
+  path.assign(1, ROOT);
+
+  for (std::size_t i = 0; i < word.length(); i++) {
+    unsigned char c = static_cast<unsigned char>(word[i]);
+    int child = next(path.back(), c);
+    if (child == -1) break;
+
+    if (!cloning && _nodes[child].indegree > 1) cloning = true;
+    if (cloning) {
+      int clone = new_node();
+      _nodes[clone].accept = _nodes[child].accept;
+      _nodes[clone].edges = _nodes[child].edges;
+      _nodes[clone].indegree = 1;
+      for (std::size_t j = 0; j < _nodes[clone].edges.size(); j++) {
+        _nodes[_nodes[clone].edges[j].second].indegree++;
       }
+      _nodes[child].indegree--;
+      edge(path.back(), c)->second = clone;
+      child = clone;
     } else {
-      replace_map[s] = replace_map[swap_map[s]];
+      _register.erase(child);
     }
+    path.push_back(child);
   }
+}
+
+// bring the nodes of an unshared path back into the register, bottom up:
+// a node equivalent to a registered one is replaced by it, and a node which
+// no longer leads to any word is removed.
+void DAWG::reregister(const std::string& word, std::vector<int>& path)
+{
+  for (std::size_t i = path.size() - 1; i > 0; i--) {
+    int node = path[i];
+    Edges::iterator iter = edge(path[i-1], static_cast<unsigned char>(word[i-1]));
+
+    if (!_nodes[node].accept && _nodes[node].edges.empty()) {
+      _nodes[path[i-1]].edges.erase(iter);
+      delete_node(node);
+      continue;
+    }
 
-  for (std::size_t i = 0; _states[i].id < static_cast<int>(minimum_size); i++) {
-    for (std::size_t input = 0; input < 256; input++) {
-      int n = _states[i][input];
-      if (n != REJECT) _states[i][input] = replace_map[n];
+    std::set<int, NodeLess>::iterator equivalent = _register.find(node);
+    if (equivalent == _register.end()) {
+      _register.insert(node);
+    } else if (*equivalent != node) {
+      iter->second = *equivalent;
+      _nodes[*equivalent].indegree++;
+      _nodes[node].indegree = 0;
+      delete_node(node);
     }
   }
-
-  _states.resize(minimum_size);
 }
 
-bool DFA::accept(const std::string& text) const
+// insert/erase return false if the word was already present/absent.
+// both run in time O(|word| log |DAWG|) plus the cloned edges.
+bool DAWG::insert(const std::string& word)
 {
-  int state = START;
-  for (std::size_t i = 0; i < text.length(); i++) {
-    state = _states[state][static_cast<unsigned char>(text[i])];
-    if (state == REJECT) return false;
+  if (accept(word)) return false;
+
+  std::vector<int> path;
+  unshare(word, path);
+
+  for (std::size_t i = path.size() - 1; i < word.length(); i++) {
+    int node = new_node();
+    unsigned char c = static_cast<unsigned char>(word[i]);
+    Edges& edges = _nodes[path.back()].edges;
+    edges.insert(std::lower_bound(edges.begin(), edges.end(), std::make_pair(c, INT_MIN)),
+                 std::make_pair(c, node));
+    _nodes[node].indegree = 1;
+    path.push_back(node);
   }
+  _nodes[path.back()].accept = true;
+  reregister(word, path);
 
-  return accept(state);
+  return true;
 }
 
-// TODO: advanced optimization for Power of Matrix.
-// Does anyone know good (multi-precision) matrix library?
+bool DAWG::erase(const std::string& word)
+{
+  if (!accept(word)) return false;
 
-typedef mpz_class Value;
+  std::vector<int> path;
+  unshare(word, path);
+  _nodes[path.back()].accept = false;
+  reregister(word, path);
 
-class MPMatrix {
- public:
-  MPMatrix(std::size_t i = 0): _size(i), m(_size*_size) {}
-  MPMatrix(std::size_t row, std::size_t col): _size(row), m(_size*_size) {}
-  MPMatrix(const MPMatrix &M) { *this = M; }
-  void resize(std::size_t n) { resize(n, n); }
-  void resize(std::size_t row, std::size_t col) { _size = row; m.resize(_size*_size); }
-  friend std::ostream& operator<<(std::ostream& stream, const MPMatrix& matrix);
-  std::size_t size() const { return _size; }
-  void clear();
-  void init();
-  void swap(MPMatrix &M) { m.swap(M.m); }
-  Value& operator()(std::size_t i, std::size_t j) { return m[i*_size+j]; }
-  const Value& operator()(std::size_t i, std::size_t j) const { return m[i*_size+j]; }
-  const Value& value(std::size_t i, std::size_t j) const { return m[i*_size+j]; }
-  MPMatrix& operator*=(const MPMatrix&);
-  std::vector<std::set<std::size_t> >& scc(std::vector<std::set<std::size_t> >&) const;
-  MPMatrix& sub_matrix(const std::set<std::size_t>&, MPMatrix&) const;
-  double frobenius_root() const;
+  return true;
+}
 
- private:
-  // for scc
-  void visit1(std::set<std::size_t>&, std::size_t, std::vector<std::size_t>&) const;
-  void visit2(std::set<std::size_t>&, std::size_t, std::set<std::size_t>&) const;
+// merge the (unregistered) branch hanging from the last edge of the given
+// node into the register, bottom up.
+void DAWG::replace_or_register(int state)
+{
+  std::vector<int> path;
+  for (int n = state; !_nodes[n].edges.empty(); n = _nodes[n].edges.back().second) {
+    path.push_back(n);
+  }
 
-  // fields
-  std::size_t _size;
-  std::vector<Value> m;
-};
+  while (!path.empty()) {
+    Edges& edges = _nodes[path.back()].edges;
+    int child = edges.back().second;
+    path.pop_back();
 
-class MPIdentityMatrix: public MPMatrix {
- public:
-  MPIdentityMatrix(std::size_t n): MPMatrix(n, n)
-  {
-    for (std::size_t i = 0; i < n; i++) (*this)(i, i) = 1;
+    std::set<int, NodeLess>::iterator iter = _register.find(child);
+    if (iter == _register.end()) {
+      _register.insert(child);
+    } else {
+      edges.back().second = *iter;
+      _nodes[*iter].indegree++;
+      _nodes[child].indegree = 0;
+      delete_node(child);
+    }
   }
+}
+
+// rans::ThreadPool runs parallel_for() loops on a fixed set of threads
+// (pthreads). the range of a loop is cut into chunks which are dealt out
+// to per-thread deques; a thread which runs dry steals chunks from the
+// back of the others' deques. the calling thread works too, and a loop
+// started while the pool is busy (e.g. a nested one) runs inline.
+// tasks report errors by throwing const char*, which parallel_for()
+// rethrows in the caller once the loop is over. std::bad_alloc is rethrown
+// as such and anything else as "parallel task failed", the same whether
+// the loop ran on the pool or inline.
+class ThreadPool {
+ public:
+  class Task {
+   public:
+    virtual ~Task() {}
+    virtual void operator()(std::size_t begin, std::size_t end) = 0;
+  };
+  explicit ThreadPool(std::size_t threads = 0) { pthread_mutex_init(&_busy, NULL); start(threads); }
+  ~ThreadPool() { stop(); pthread_mutex_destroy(&_busy); }
+  std::size_t size() const { return _queues.size(); }
+  void resize(std::size_t);
+  void parallel_for(std::size_t, Task&, std::size_t);
+  // the pool shared by the library (one thread per online core).
+  static ThreadPool& shared() { static ThreadPool pool; return pool; }
+ private:
+  //DISALLOW COPY AND ASSIGN
+  ThreadPool(const ThreadPool&);
+  void operator=(const ThreadPool&);
+  typedef std::pair<std::size_t, std::size_t> Chunk;
+  struct Queue {
+    Queue() { pthread_mutex_init(&mutex, NULL); }
+    ~Queue() { pthread_mutex_destroy(&mutex); }
+    pthread_mutex_t mutex;
+    std::deque<Chunk> chunks;
+  };
+  struct Worker {
+    ThreadPool* pool;
+    std::size_t self;
+  };
+  static void* run(void*);
+  void start(std::size_t);
+  void stop();
+  bool pop(std::size_t, Chunk&);
+  void work(std::size_t);
+  static const char* attempt(Task&, std::size_t, std::size_t);
+  static void raise(const char*);
+  static const char* out_of_memory() { static const char error[] = "out of memory"; return error; }
+  // fields
+  std::vector<pthread_t> _threads;
+  std::vector<Worker> _workers;
+  std::vector<Queue*> _queues;
+  pthread_mutex_t _busy;
+  pthread_mutex_t _mutex;
+  pthread_cond_t _wake;
+  pthread_cond_t _done;
+  Task* _task;
+  std::size_t _generation;
+  std::size_t _pending;
+  const char* _error;
+  bool _stop;
 };
 
-MPMatrix& MPMatrix::operator*=(const MPMatrix &M)
+void ThreadPool::start(std::size_t threads)
 {
-  MPMatrix tmp(size(), size());
-  for (std::size_t i = 0; i < size(); i++) {
-    for (std::size_t j = 0; j < size(); j++) {
-      for (std::size_t k = 0; k < size(); k++) {
-        tmp(i, j) += (*this)(i, k) * M(k, j);
-      }
-    }
+  if (threads == 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cores > 0 ? cores : 1;
+  }
+
+  pthread_mutex_init(&_mutex, NULL);
+  pthread_cond_init(&_wake, NULL);
+  pthread_cond_init(&_done, NULL);
+  _task = NULL;
+  _generation = _pending = 0;
+  _error = NULL;
+  _stop = false;
+
+  for (std::size_t i = 0; i < threads; i++) _queues.push_back(new Queue);
+  _workers.resize(threads);
+  _threads.resize(threads - 1);
+  for (std::size_t i = 1; i < threads; i++) {
+    _workers[i].pool = this;
+    _workers[i].self = i;
+    pthread_create(&_threads[i-1], NULL, &ThreadPool::run, &_workers[i]);
   }
-  swap(tmp);
-  return *this;
 }
 
-void MPMatrix::clear()
+void ThreadPool::stop()
 {
-  for (std::size_t i = 0; i < size(); i++) {
-    for (std::size_t j = 0; j < size(); j++) {
-      (*this)(i, j) = 0;
+  pthread_mutex_lock(&_mutex);
+  _stop = true;
+  pthread_cond_broadcast(&_wake);
+  pthread_mutex_unlock(&_mutex);
+
+  for (std::size_t i = 0; i < _threads.size(); i++) pthread_join(_threads[i], NULL);
+  for (std::size_t i = 0; i < _queues.size(); i++) delete _queues[i];
+  _threads.clear();
+  _workers.clear();
+  _queues.clear();
+
+  pthread_cond_destroy(&_done);
+  pthread_cond_destroy(&_wake);
+  pthread_mutex_destroy(&_mutex);
+}
+
+void ThreadPool::resize(std::size_t threads)
+{
+  pthread_mutex_lock(&_busy);
+  stop();
+  start(threads);
+  pthread_mutex_unlock(&_busy);
+}
+
+void* ThreadPool::run(void* arg)
+{
+  Worker* worker = static_cast<Worker*>(arg);
+  ThreadPool& pool = *worker->pool;
+  std::size_t generation = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&pool._mutex);
+    while (!pool._stop && pool._generation == generation) {
+      pthread_cond_wait(&pool._wake, &pool._mutex);
     }
+    bool stop = pool._stop;
+    generation = pool._generation;
+    pthread_mutex_unlock(&pool._mutex);
+
+    if (stop) return NULL;
+    pool.work(worker->self);
   }
 }
 
-void MPMatrix::init()
+// pop a chunk from our own deque, or steal one from another's.
+bool ThreadPool::pop(std::size_t self, Chunk& chunk)
 {
   for (std::size_t i = 0; i < size(); i++) {
-    for (std::size_t j = 0; j < size(); j++) {
-      (*this)(i, j) = i == j ? 1 : 0;
+    Queue& queue = *_queues[(self + i) % size()];
+    pthread_mutex_lock(&queue.mutex);
+    bool found = !queue.chunks.empty();
+    if (found && i == 0) {
+      chunk = queue.chunks.front();
+      queue.chunks.pop_front();
+    } else if (found) {
+      chunk = queue.chunks.back();
+      queue.chunks.pop_back();
     }
+    pthread_mutex_unlock(&queue.mutex);
+    if (found) return true;
   }
-}
 
+  return false;
+}
 
-std::vector<std::set<std::size_t> >& MPMatrix::scc(std::vector<std::set<std::size_t> >& sccs) const
+void ThreadPool::work(std::size_t self)
 {
-  sccs.clear();
-  std::set<std::size_t> elem;
-  std::vector<std::size_t> num;
-
-  for (std::size_t i = 0; i < size(); i++) {
-    if (elem.find(i) == elem.end()) visit1(elem, i, num);
-  }
-  elem.clear();
-  for (std::vector<std::size_t>::reverse_iterator iter = num.rbegin();
-       iter != num.rend(); ++iter) {
-    std::set<std::size_t> scc_;
-    if (elem.find(*iter) == elem.end()) visit2(elem, *iter, scc_);
-    if (scc_.size() == 1 && value(*iter, *iter) == 0) continue;
-    if (!scc_.empty()) sccs.push_back(scc_);
+  Chunk chunk;
+
+  while (pop(self, chunk)) {
+    const char* error = attempt(*_task, chunk.first, chunk.second);
+    pthread_mutex_lock(&_mutex);
+    if (error != NULL && _error == NULL) _error = error;
+    if (--_pending == 0) pthread_cond_signal(&_done);
+    pthread_mutex_unlock(&_mutex);
   }
-
-  return sccs;
 }
 
-void MPMatrix::visit1(std::set<std::size_t>& elem, std::size_t v, std::vector<std::size_t>& num) const
+// task(begin, end), and the error it threw (NULL if none).
+const char* ThreadPool::attempt(Task& task, std::size_t begin, std::size_t end)
 {
-  // vertex numbering based on post-order
-  elem.insert(v);
-  for (std::size_t i = 0; i < size(); i++) {
-    if (value(v, i) != 0 && elem.find(i) == elem.end()) {
-      visit1(elem, i, num);
-    }
+  try {
+    task(begin, end);
+  } catch (const char* error) {
+    return error;
+  } catch (const std::bad_alloc&) {
+    return out_of_memory();
+  } catch (...) {
+    return "parallel task failed";
   }
-  num.push_back(v);
+  return NULL;
 }
 
-void MPMatrix::visit2(std::set<std::size_t>& elem, std::size_t v, std::set<std::size_t>& scc_) const
+void ThreadPool::raise(const char* error)
+{
+  if (error == out_of_memory()) throw std::bad_alloc();
+  if (error != NULL) throw error;
+}
+
+// run task(begin, end) over [0, n), in chunks of at least 'grain' indices.
+// the pool is held (against resize() and nested loops) before its size is read.
+void ThreadPool::parallel_for(std::size_t n, Task& task, std::size_t grain = 1)
+{
+  if (n == 0) return;
+  bool pooled = pthread_mutex_trylock(&_busy) == 0;
+  if (pooled && (size() == 1 || n <= grain)) {
+    pthread_mutex_unlock(&_busy);
+    pooled = false;
+  }
+  if (!pooled) {
+    raise(attempt(task, 0, n));
+    return;
+  }
+
+  std::size_t step = std::max(grain, n / (8 * size()) + 1);
+  pthread_mutex_lock(&_mutex);
+  _task = &task;
+  _error = NULL;
+  _pending = (n + step - 1) / step;
+  pthread_mutex_unlock(&_mutex);
+
+  for (std::size_t begin = 0, i = 0; begin < n; begin += step, i++) {
+    Queue& queue = *_queues[i % size()];
+    pthread_mutex_lock(&queue.mutex);
+    queue.chunks.push_back(Chunk(begin, std::min(n, begin + step)));
+    pthread_mutex_unlock(&queue.mutex);
+  }
+
+  pthread_mutex_lock(&_mutex);
+  _generation++;
+  pthread_cond_broadcast(&_wake);
+  pthread_mutex_unlock(&_mutex);
+
+  work(0);
+
+  pthread_mutex_lock(&_mutex);
+  while (_pending != 0) pthread_cond_wait(&_done, &_mutex);
+  const char* error = _error;
+  pthread_mutex_unlock(&_mutex);
+
+  pthread_mutex_unlock(&_busy);
+  raise(error);
+}
+
+class DFA {
+ public:
+  enum State_t { REJECT = -1, START = 0 };
+  enum Product { INTERSECTION, DIFFERENCE };
+  typedef std::set<Parser::Expr*> Subset;
+  struct State {
+    int t[256];
+    int id;
+    bool accept;
+    int operator[](std::size_t i) const { return t[i]; }
+    int& operator[](std::size_t i) { return t[i]; }
+  };
+  DFA(const std::string&, Encoding, bool, bool, bool, const Limits&);
+  DFA(const std::vector<std::string>&);
+  DFA(const DAWG& dawg): _ok(true), _factorial(false), _ignorecase(false) { construct(dawg); }
+  DFA(Parser::Expr*, bool, const Budget&);
+  DFA(const DFA&, const DFA&, Product, const Budget&);
+  static std::size_t estimate(const std::string&, Encoding, bool, bool);
+  bool ok() const { return _ok; }
+  bool factorial() const { return _factorial; }
+  bool ignorecase() const { return _ignorecase; }
+  const std::string& error() const { return _error; }
+  std::size_t size() const { return _states.size(); }
+  const State& state(std::size_t i) const { return _states[i]; }
+  State& state(std::size_t i) { return _states[i]; }
+  bool accept(int state) const { return state != REJECT && _states[state].accept; }
+  bool accept(const std::string&) const;
+  const State& operator[](std::size_t i) const { return _states[i]; }
+  State& operator[](std::size_t i) { return _states[i]; }
+  // BFS levels of the subset construction smaller than this are expanded
+  // inline, without starting the ThreadPool.
+  static const std::size_t kParallelLevel = 64;
+  void minimize();
+  void trim();
+  bool operator==(const DFA&) const;
+  friend std::ostream& operator<<(std::ostream& stream, const DFA& dfa);
+ private:
+  class SubsetTable;
+  class Expansion;
+  void construct(Parser::Expr* expr);
+  void construct(const DAWG&);
+  void factor();
+  void fill_transition(Parser::Expr*, std::vector<Subset>&) const;
+  State& new_state();
+  static std::string& pretty(unsigned char, std::string &);
+
+  //fields
+  bool _ok;
+  bool _factorial;
+  bool _ignorecase;
+  std::string _error;
+  std::deque<State> _states;
+  Budget _budget;
+};
+
+bool DFA::operator==(const DFA& lhs) const
+{
+  if (state(START).accept != lhs.state(START).accept) return false;
+  
+  std::set<std::pair<int, int> > equivalent_states;
+  equivalent_states.insert(std::pair<int, int>(REJECT, REJECT));
+  equivalent_states.insert(std::pair<int, int>(START, START));
+  std::queue<std::pair<int, int> > queue;
+  queue.push(std::pair<int, int>(START, START));
+
+  while (!queue.empty()) {
+    std::pair<int, int> pair = queue.front();
+    queue.pop();
+
+    const State& s1 = state(pair.first);
+    const State& s2 = lhs.state(pair.second);
+    if (s1.accept != s2.accept) return false;
+
+    for (std::size_t c = 0; c < 256; c++) {
+      std::pair<int, int> next(s1[c], s2[c]);
+
+      if (equivalent_states.find(next) == equivalent_states.end()) {
+        if (next.first == REJECT || next.second == REJECT) return false;
+
+        equivalent_states.insert(next);
+        queue.push(next);
+      }
+    }
+  }
+  
+  return true;
+}
+
+std::ostream& operator<<(std::ostream& stream, const DFA& dfa)
+{
+  static const char* const state_circle = "circle";
+  static const char* const accept_circle = "doublecircle";
+  static const char* const style  = "fillcolor=lightsteelblue1, style=filled, color = navyblue ";
+
+  stream << "digraph DFA {\n  rankdir=\"LR\"" << std::endl;
+  for (std::size_t i = 0; i < dfa.size(); i++) {
+    stream << "  " << i << " [shape= " << (dfa[i].accept ? accept_circle : state_circle)
+           << ", " << style << "]" << std::endl;
+  }
+  stream << "  start [shape=point]\n  start -> " << DFA::START << std::endl;
+
+  std::string label;
+  for (std::size_t i = 0; i < dfa.size(); i++) {
+    bool range = false; unsigned char last;
+    for (unsigned int c = 0; c < 256; c++) {
+      if (dfa[i][c] != DFA::REJECT) {
+        if (range && !(c + 1 < 256 && dfa[i][c] == dfa[i][c+1])) {
+          stream << DFA::pretty(c, label) << "]\"]" << std::endl;
+          range = false;
+        } else if (c + 1 < 256 && dfa[i][c] == dfa[i][c+1]) {
+          if (range) continue;
+          range = true;
+          last = c;
+          stream << "  " << i << " -> " << dfa[i][c]
+                 << " [label=\"[" << DFA::pretty(c, label) << "-";
+        } else {
+          stream << "  " << i << " -> " << dfa[i][c]
+                 << " [label=\"" << DFA::pretty(c, label) << "\"]" << std::endl;
+        }
+      }
+    }
+  }
+  stream << "}" << std::endl;
+  
+  return stream;
+}
+
+std::string& rans::DFA::pretty(unsigned char c, std::string &label)
+{
+  std::stringstream label_;
+  if (' ' <= c && c <= '~') {
+    if (c == '"' || c == '\\') label_ << '\\';
+    label_ << c;
+  } else {
+    label_ << std::showbase << std::hex << static_cast<unsigned int>(c);
+  }
+
+  label_ >> label;
+  return label;
+}
+
+DFA::DFA(const std::string &regex, Encoding enc = ASCII, bool minimizing = true, bool factorial = false, bool ignorecase = false,
+         const Limits& limits = Limits()):
+    _ok(true), _factorial(factorial), _ignorecase(ignorecase), _budget(limits)
+{
+  { // the expression tree is released in bulk before minimization
+    Parser p(regex, enc, ignorecase, _budget);
+    if (!p.ok()) {
+      _ok = false;
+      _error = p.error();
+      return;
+    }
+
+    try {
+      construct(p.expr_tree());
+    } catch (const char* error) {
+      _ok = false;
+      _error = "dfa construct error: ";
+      _error += error;
+      return;
+    }
+  }
+
+  try {
+    if (_factorial) {
+      minimize();
+      factor();
+    }
+  } catch (const char* error) {
+    _ok = false;
+    _error = "dfa construct error: ";
+    _error += error;
+    return;
+  }
+
+  try {
+    if (minimizing || _factorial) minimize();
+  } catch (const char* error) {
+    _ok = false;
+    _error = "dfa minimize error: ";
+    _error += error;
+  }
+}
+
+// the subsets found so far, sharded by hash so that threads expanding a
+// BFS level rarely contend. ids are handed out in order of arrival, which
+// depends on scheduling; construct() renumbers states at the end.
+class DFA::SubsetTable {
+ public:
+  typedef std::vector<std::pair<int, const Subset*> > Created;
+  SubsetTable(): _size(0), _positions(0) { for (std::size_t i = 0; i < kShards; i++) pthread_mutex_init(&_mutex[i], NULL); }
+  ~SubsetTable() { for (std::size_t i = 0; i < kShards; i++) pthread_mutex_destroy(&_mutex[i]); }
+  int size() { return __sync_fetch_and_add(&_size, 0); }
+  // roughly: the subsets (set nodes), and a State for each.
+  std::size_t bytes() { return size() * (sizeof(State) + 64) + __sync_fetch_and_add(&_positions, 0) * 48; }
+  // the id of the subset. a new subset is also appended to 'created'.
+  int intern(const Subset& subset, Created& created)
+  {
+    std::size_t hash = subset.size();
+    for (Subset::const_iterator iter = subset.begin(); iter != subset.end(); ++iter) {
+      hash = hash * 31 + (*iter)->id;
+    }
+    std::size_t shard = hash % kShards;
+
+    pthread_mutex_lock(&_mutex[shard]);
+    std::map<Subset, int>::iterator iter = _table[shard].find(subset);
+    if (iter == _table[shard].end()) {
+      iter = _table[shard].insert(std::make_pair(subset, __sync_fetch_and_add(&_size, 1))).first;
+      __sync_fetch_and_add(&_positions, subset.size());
+      created.push_back(std::make_pair(iter->second, &iter->first));
+    }
+    int id = iter->second;
+    pthread_mutex_unlock(&_mutex[shard]);
+
+    return id;
+  }
+ private:
+  static const std::size_t kShards = 64;
+  pthread_mutex_t _mutex[kShards];
+  std::map<Subset, int> _table[kShards];
+  int _size;
+  std::size_t _positions;
+};
+
+// expands the subsets of one BFS level: the state of frontier[i] gets its
+// transitions (as subset ids), and created[i] the subsets it found first.
+class DFA::Expansion: public ThreadPool::Task {
+ public:
+  Expansion(const DFA& dfa, SubsetTable& table, const SubsetTable::Created& frontier,
+            std::deque<State>& states, std::vector<SubsetTable::Created>& created):
+      _dfa(dfa), _table(table), _frontier(frontier), _states(states), _created(created) {}
+  void operator()(std::size_t begin, std::size_t end)
+  {
+    std::vector<Subset> transition(256);
+
+    for (std::size_t i = begin; i < end; i++) {
+      const Subset& subset = *_frontier[i].second;
+      State& state = _states[_frontier[i].first];
+      state.accept = false;
+      std::fill(transition.begin(), transition.end(), Subset());
+
+      for (Subset::const_iterator iter = subset.begin(); iter != subset.end(); ++iter) {
+        state.accept |= (*iter)->type == Parser::kEOP;
+        _dfa.fill_transition(*iter, transition);
+      }
+
+      for (std::size_t c = 0; c < 256; c++) {
+        state[c] = transition[c].empty() ? REJECT : _table.intern(transition[c], _created[i]);
+      }
+      _dfa._budget.check(_table.size(), _table.bytes());
+    }
+  }
+ private:
+  const DFA& _dfa;
+  SubsetTable& _table;
+  const SubsetTable::Created& _frontier;
+  std::deque<State>& _states;
+  std::vector<SubsetTable::Created>& _created;
+};
+
+// construct() is a level-synchronous subset construction: the subsets of
+// each BFS level are expanded in parallel on the shared ThreadPool (small
+// levels inline), and their successors are interned in a concurrent table.
+// at the end states are renumbered in place in canonical BFS order (by
+// ascending bytes, as a single queue would find them), so the result
+// doesn't depend on scheduling.
+void DFA::construct(Parser::Expr* expr_tree)
+{
+  std::deque<State> states; // by subset id; a deque grows without copying
+
+  { // the subsets are freed before the states are renumbered
+    SubsetTable table;
+    SubsetTable::Created frontier;
+
+    Subset first;
+    Parser::first(expr_tree, first);
+    table.intern(first, frontier);
+
+    while (!frontier.empty()) {
+      std::vector<SubsetTable::Created> created(frontier.size());
+      states.resize(table.size());
+      Expansion expansion(*this, table, frontier, states, created);
+      if (frontier.size() < kParallelLevel) expansion(0, frontier.size());
+      else ThreadPool::shared().parallel_for(frontier.size(), expansion, 16);
+
+      frontier.clear();
+      for (std::size_t i = 0; i < created.size(); i++) {
+        frontier.insert(frontier.end(), created[i].begin(), created[i].end());
+      }
+    }
+  }
+
+  // every subset is reachable, so the BFS numbers all of them.
+  std::vector<int> replace_map(states.size(), REJECT), queue(1, START);
+  replace_map[START] = START;
+  for (std::size_t i = 0; i < queue.size(); i++) {
+    const State& state = states[queue[i]];
+    for (std::size_t c = 0; c < 256; c++) {
+      if (state[c] != REJECT && replace_map[state[c]] == REJECT) {
+        replace_map[state[c]] = queue.size();
+        queue.push_back(state[c]);
+      }
+    }
+  }
+  std::vector<int>().swap(queue);
+
+  for (std::size_t i = 0; i < states.size(); i++) {
+    State& state = states[i];
+    for (std::size_t c = 0; c < 256; c++) {
+      if (state[c] != REJECT) state[c] = replace_map[state[c]];
+    }
+    state.id = replace_map[i];
+  }
+  // permute by cycles: swap each state into its place.
+  for (std::size_t i = 0; i < states.size(); i++) {
+    while (states[i].id != static_cast<int>(i)) std::swap(states[i], states[states[i].id]);
+  }
+  _states.swap(states);
+}
+
+void DFA::fill_transition(Parser::Expr* expr, std::vector<DFA::Subset>& transition) const
+{
+  switch (expr->type) {
+    case Parser::kLiteral: {
+      unsigned char index = expr->literal;
+      transition[index].insert(expr->follow.begin(), expr->follow.end());
+      if (ignorecase()) {
+        unsigned char index_ = opposite_case(index);
+        if (index_ != index) transition[index_].insert(expr->follow.begin(), expr->follow.end());
+      }
+      break;
+    }
+    case Parser::kCharClass: {
+      for (std::size_t c = 0; c < 256; c++) {
+        if ((*expr->cc_table)[c]) {
+          transition[c].insert(expr->follow.begin(), expr->follow.end());
+          if (ignorecase()) {
+            unsigned char c_ = opposite_case(static_cast<unsigned char>(c));
+            if (c_ != c && !(*expr->cc_table)[c_]) transition[c_].insert(expr->follow.begin(), expr->follow.end());
+          }
+        }
+      }
+      break;
+    }
+    case Parser::kDot: {
+      for (std::size_t c = 0; c < 256; c++) {
+        transition[c].insert(expr->follow.begin(), expr->follow.end());
+      }
+      break;
+    }
+    case Parser::kEOP: break;
+    default: throw "can't handle the type";
+  }
+}
+
+// an upper bound on the number of states of the DFA of the regex (before
+// minimization), see Parser::estimate(). 0 if the regex is invalid.
+// the products of '&', '-' and '~' are bounded, not built.
+std::size_t DFA::estimate(const std::string& regex, Encoding enc = ASCII, bool factorial = false, bool ignorecase = false)
+{
+  Parser p(regex, enc, ignorecase, Budget(), true);
+  return p.ok() ? p.estimate(factorial, ignorecase) : 0;
+}
+
+// the minimal DFA of a (sub)expression whose follow sets are filled,
+// terminated by kEOP. parse errors are thrown to the Parser.
+DFA::DFA(Parser::Expr* expr_tree, bool ignorecase, const Budget& budget):
+    _ok(true), _factorial(false), _ignorecase(ignorecase), _budget(budget)
+{
+  construct(expr_tree);
+  minimize();
+}
+
+// the product automaton of lhs and rhs, which accepts the intersection
+// (or the difference) of their languages. only pairs reachable from
+// (START, START) are built, and rhs' REJECT is kept as a sink, so the
+// difference needs no complete DFA.
+DFA::DFA(const DFA& lhs, const DFA& rhs, Product op, const Budget& budget):
+    _ok(true), _factorial(false), _ignorecase(false), _budget(budget)
+{
+  std::map<std::pair<int, int>, int> pair_to_state;
+  std::vector<std::pair<int, int> > queue(1, std::make_pair(int(START), int(START)));
+  pair_to_state[queue.front()] = START;
+
+  for (std::size_t i = 0; i < queue.size(); i++) {
+    const std::pair<int, int> pair = queue[i];
+    bool accept = lhs.accept(pair.first) && (op == INTERSECTION) == rhs.accept(pair.second);
+    new_state().accept = accept;
+    _budget.check(queue.size(), queue.size() * (sizeof(State) + 64));
+
+    for (std::size_t c = 0; c < 256; c++) {
+      std::pair<int, int> next(lhs[pair.first][c],
+                               pair.second == REJECT ? REJECT : rhs[pair.second][c]);
+      if (next.first == REJECT || (op == INTERSECTION && next.second == REJECT)) continue;
+
+      std::map<std::pair<int, int>, int>::iterator iter = pair_to_state.find(next);
+      if (iter == pair_to_state.end()) {
+        iter = pair_to_state.insert(std::make_pair(next, static_cast<int>(queue.size()))).first;
+        queue.push_back(next);
+      }
+      _states[i][c] = iter->second;
+    }
+  }
+
+  trim();
+  minimize();
+}
+
+// trim() removes the states from which no accepting state is reachable
+// (but START), so that REJECT is the only dead state.
+void DFA::trim()
+{
+  std::vector<std::vector<int> > reverse(size());
+  std::vector<bool> live(size(), false);
+  std::vector<int> stack;
+
+  for (std::size_t i = 0; i < size(); i++) {
+    if (_states[i].accept) {
+      live[i] = true;
+      stack.push_back(i);
+    }
+    for (std::size_t c = 0; c < 256; c++) {
+      int next = _states[i][c];
+      if (next != REJECT && (c == 0 || next != _states[i][c-1])) reverse[next].push_back(i);
+    }
+  }
+
+  while (!stack.empty()) {
+    int state = stack.back();
+    stack.pop_back();
+    for (std::size_t i = 0; i < reverse[state].size(); i++) {
+      if (!live[reverse[state][i]]) {
+        live[reverse[state][i]] = true;
+        stack.push_back(reverse[state][i]);
+      }
+    }
+  }
+  live[START] = true;
+
+  std::vector<int> replace_map(size(), REJECT);
+  std::size_t live_size = 0;
+  for (std::size_t i = 0; i < size(); i++) {
+    if (live[i]) replace_map[i] = live_size++;
+  }
+  if (live_size == size()) return;
+
+  for (std::size_t i = 0; i < size(); i++) {
+    if (!live[i]) continue;
+    State& state = _states[replace_map[i]];
+    state = _states[i];
+    state.id = replace_map[i];
+    for (std::size_t c = 0; c < 256; c++) {
+      if (state[c] != REJECT) state[c] = replace_map[state[c]];
+    }
+  }
+  _states.resize(live_size);
+}
+
+// factor() turns the (minimal) DFA into a DFA of the factors (substrings)
+// of its language: every live state becomes initial and accepting, and the
+// resulting NFA is determinized over sets of states. this is far smaller
+// than a subset construction that starts from every position of the regex.
+void DFA::factor()
+{
+  trim();
+
+  std::vector<int> initial(size());
+  for (std::size_t i = 0; i < size(); i++) initial[i] = i;
+
+  std::map<std::vector<int>, int> subset_to_state;
+  std::vector<const std::vector<int>*> queue;
+  std::deque<State> states;
+  queue.push_back(&subset_to_state.insert(std::make_pair(initial, int(START))).first->first);
+
+  for (std::size_t i = 0; i < queue.size(); i++) {
+    const std::vector<int>& subset = *queue[i];
+    states.resize(states.size() + 1);
+    State& state = states.back();
+    state.id = i;
+    state.accept = true;
+    _budget.check(queue.size(), subset_to_state.size() * (sizeof(State) + 64));
+
+    for (std::size_t c = 0; c < 256; c++) {
+      std::vector<int> next;
+      for (std::size_t j = 0; j < subset.size(); j++) {
+        if (_states[subset[j]][c] != REJECT) next.push_back(_states[subset[j]][c]);
+      }
+      if (next.empty()) {
+        state[c] = REJECT;
+        continue;
+      }
+      std::sort(next.begin(), next.end());
+      next.erase(std::unique(next.begin(), next.end()), next.end());
+
+      std::map<std::vector<int>, int>::iterator iter = subset_to_state.find(next);
+      if (iter == subset_to_state.end()) {
+        iter = subset_to_state.insert(std::make_pair(next, static_cast<int>(queue.size()))).first;
+        queue.push_back(&iter->first);
+      }
+      state[c] = iter->second;
+    }
+  }
+
+  _states.swap(states);
+}
+
+// the minimal DFA of a finite set of words (sorted or not), built without
+// going through Parser and minimize().
+DFA::DFA(const std::vector<std::string>& words): _ok(true), _factorial(false), _ignorecase(false)
+{
+  try {
+    DAWG dawg(words);
+    construct(dawg);
+  } catch (const char* error) {
+    _ok = false;
+    _error = "dfa construct error: ";
+    _error += error;
+  }
+}
+
+void DFA::construct(const DAWG& dawg)
+{
+  std::vector<int> node_to_state(dawg.capacity(), REJECT);
+  std::vector<int> queue(1, DAWG::ROOT);
+  node_to_state[DAWG::ROOT] = START;
+
+  for (std::size_t i = 0; i < queue.size(); i++) {
+    const DAWG::Node& node = dawg.node(queue[i]);
+    new_state().accept = node.accept;
+
+    for (std::size_t j = 0; j < node.edges.size(); j++) {
+      int next = node.edges[j].second;
+      if (node_to_state[next] == REJECT) {
+        node_to_state[next] = queue.size();
+        queue.push_back(next);
+      }
+      _states[i][node.edges[j].first] = node_to_state[next];
+    }
+  }
+}
+
+DFA::State& DFA::new_state()
+{
+  _states.resize(_states.size() + 1);
+  State& state = _states.back();
+  std::fill(state.t, state.t+256, REJECT);
+  state.id = _states.size() - 1;
+  return state;
+}
+
+// minimize() merges equivalent states by partition refinement (Hopcroft,
+// "An n log n algorithm for minimizing states in a finite automaton", 1971).
+// REJECT takes part as an explicit sink state, so states which can't reach
+// an accepting state are merged into it. the minimal states keep the order
+// of their first original state (START stays START).
+void DFA::minimize()
+{
+  const std::size_t n = size() + 1, sink = size();
+  _budget.check(0, n * 256 * 2 * sizeof(int));
+  std::vector<int> inverse_begin(n * 256 + 1, 0), inverse;
+
+  // predecessors of each (state, byte), in a flat array.
+  for (std::size_t q = 0; q < n; q++) {
+    for (std::size_t c = 0; c < 256; c++) {
+      int t = q == sink || _states[q][c] == REJECT ? sink : _states[q][c];
+      inverse_begin[t * 256 + c + 1]++;
+    }
+  }
+  for (std::size_t i = 1; i < inverse_begin.size(); i++) inverse_begin[i] += inverse_begin[i-1];
+  inverse.resize(inverse_begin.back());
+  std::vector<int> fill(inverse_begin.begin(), inverse_begin.end() - 1);
+  for (std::size_t q = 0; q < n; q++) {
+    for (std::size_t c = 0; c < 256; c++) {
+      int t = q == sink || _states[q][c] == REJECT ? sink : _states[q][c];
+      inverse[fill[t * 256 + c]++] = q;
+    }
+  }
+
+  // blocks are ranges [first, last) of 'elements'.
+  std::vector<int> elements(n), location(n), block(n);
+  std::vector<std::size_t> first, last, marked;
+  std::vector<bool> waiting;
+  std::vector<int> worklist, touched, splitter, predecessors;
+
+  for (int accept = 1; accept >= 0; accept--) {
+    std::size_t begin = first.empty() ? 0 : last.back(), end = begin;
+    for (std::size_t q = 0; q < n; q++) {
+      if ((q != sink && _states[q].accept) == (accept == 1)) {
+        elements[end] = q; location[q] = end++;
+        block[q] = first.size();
+      }
+    }
+    if (begin == end) continue;
+    first.push_back(begin); last.push_back(end); marked.push_back(0);
+    waiting.push_back(true);
+    worklist.push_back(first.size() - 1);
+  }
+
+  for (std::size_t round = 0; !worklist.empty(); round++) {
+    if (round % 256 == 0) _budget.check(0, 0);
+    int a = worklist.back();
+    worklist.pop_back();
+    waiting[a] = false;
+    splitter.assign(elements.begin() + first[a], elements.begin() + last[a]);
+
+    for (std::size_t c = 0; c < 256; c++) {
+      predecessors.clear();
+      for (std::size_t i = 0; i < splitter.size(); i++) {
+        std::size_t key = splitter[i] * 256 + c;
+        predecessors.insert(predecessors.end(), inverse.begin() + inverse_begin[key],
+                            inverse.begin() + inverse_begin[key+1]);
+      }
+
+      // move the predecessors to the front of their blocks.
+      for (std::size_t i = 0; i < predecessors.size(); i++) {
+        int q = predecessors[i], b = block[q];
+        std::size_t to = first[b] + marked[b];
+        if (marked[b] == 0) touched.push_back(b);
+        std::swap(elements[location[q]], elements[to]);
+        location[elements[location[q]]] = location[q];
+        location[q] = to;
+        marked[b]++;
+      }
+
+      for (std::size_t i = 0; i < touched.size(); i++) {
+        int b = touched[i];
+        std::size_t middle = first[b] + marked[b];
+        marked[b] = 0;
+        if (middle == last[b]) continue;
+
+        int nb = first.size();
+        first.push_back(first[b]); last.push_back(middle); marked.push_back(0);
+        first[b] = middle;
+        for (std::size_t j = first[nb]; j < last[nb]; j++) block[elements[j]] = nb;
+
+        if (waiting[b] || last[nb] - first[nb] <= last[b] - first[b]) {
+          waiting.push_back(true);
+          worklist.push_back(nb);
+        } else {
+          waiting.push_back(false);
+          waiting[b] = true;
+          worklist.push_back(b);
+        }
+      }
+      touched.clear();
+    }
+  }
+
+  if (block[START] == block[sink]) { // empty language
+    std::fill(_states[START].t, _states[START].t+256, REJECT);
+    _states.resize(1);
+    return;
+  }
+
+  // number the blocks by their first states; the sink's block is REJECT.
+  std::vector<int> replace_map(first.size(), REJECT);
+  std::size_t minimum_size = 0;
+  for (std::size_t q = 0; q < sink; q++) {
+    if (replace_map[block[q]] == REJECT && block[q] != block[sink]) {
+      replace_map[block[q]] = minimum_size++;
+    }
+  }
+
+  std::vector<bool> copied(minimum_size, false);
+  for (std::size_t q = 0; q < sink; q++) {
+    int s = replace_map[block[q]];
+    if (s == REJECT || copied[s]) continue;
+    copied[s] = true;
+    State& state = _states[s];
+    state = _states[q];
+    state.id = s;
+    for (std::size_t c = 0; c < 256; c++) {
+      if (state[c] != REJECT) state[c] = replace_map[block[state[c]]];
+    }
+  }
+
+  _states.resize(minimum_size);
+}
+
+bool DFA::accept(const std::string& text) const
+{
+  int state = START;
+  for (std::size_t i = 0; i < text.length(); i++) {
+    state = _states[state][static_cast<unsigned char>(text[i])];
+    if (state == REJECT) return false;
+  }
+
+  return accept(state);
+}
+
+// new_automaton() compiles the operands of '&', '-' (or '~') into minimal
+// DFAs, builds their product, and inlines the result as an Automaton node.
+// the positions of the operands are left unused. under ignorecase the
+// operands are folded first: folding the product afterwards would make
+// "~a" accept "a" again (through 'A').
+Parser::Expr* Parser::new_automaton(ExprType op, Expr* lhs, Expr* rhs)
+{
+  // a product of operands equal to an earlier one's is cloned from it.
+  Shape key(kAutomaton, op, shape(lhs), rhs == NULL ? 0 : shape(rhs));
+  std::map<Shape, Expr*>::iterator iter = _products.find(key);
+  if (iter != _products.end()) {
+    _reused++;
+    return clone_expr(iter->second);
+  }
+
+  Expr* e = new_product(op, lhs, rhs);
+  e->shape = _shapes.insert(std::make_pair(key, _shapes.size() + 1)).first->second;
+  _products[key] = e;
+  return e;
+}
+
+Parser::Expr* Parser::new_product(ExprType op, Expr* lhs, Expr* rhs)
+{
+  if (op == kComplement) { // ~r == .*-r
+    rhs = lhs;
+    lhs = new_expr(kStar, new_expr(kDot));
+  }
+
+  std::set<Expr*> lhs_positions, rhs_positions;
+  lhs = new_expr(kConcat, lhs, new_expr(kEOP));
+  rhs = new_expr(kConcat, rhs, new_expr(kEOP));
+  fill_transition(lhs, lhs_positions);
+  fill_transition(rhs, rhs_positions);
+
+  if (_estimating) {
+    // the product has at most the product of the operands' states, and
+    // '~' as many as its operand. only the emptiness of the word is exact.
+    std::size_t lhs_bound = estimate(lhs, lhs_positions, false, _ignorecase);
+    std::size_t rhs_bound = estimate(rhs, rhs_positions, false, _ignorecase);
+    _automata.resize(_automata.size() + 1);
+    Automaton& automaton = _automata.back();
+    automaton.bound = rhs_bound;
+    if (op != kComplement) {
+      automaton.bound = lhs_bound > static_cast<std::size_t>(-1) / rhs_bound ?
+          static_cast<std::size_t>(-1) : lhs_bound * rhs_bound;
+    }
+    Expr* position = new_expr(kDot);
+    automaton.positions.push_back(position);
+    automaton.first.insert(position);
+    automaton.last.insert(position);
+    Expr* e = new_expr(kAutomaton);
+    e->automaton = &automaton;
+    e->nullable = lhs->lhs->nullable && (op == kIntersection ? rhs->lhs->nullable : !rhs->lhs->nullable);
+    return e;
+  }
+
+  DFA dfa(DFA(lhs, _ignorecase, _budget), DFA(rhs, _ignorecase, _budget),
+          op == kIntersection ? DFA::INTERSECTION : DFA::DIFFERENCE, _budget);
+
+  _automata.resize(_automata.size() + 1);
+  Automaton& automaton = _automata.back();
+  std::vector<std::vector<Expr*> > transitions(dfa.size());
+  std::vector<int> targets;
+  std::vector<std::bitset<256> > tables;
+
+  for (std::size_t s = 0; s < dfa.size(); s++) {
+    std::map<int, std::size_t> edges; // target -> index of the position
+    for (std::size_t c = 0; c < 256; c++) {
+      int t = dfa[s][c];
+      if (t == DFA::REJECT) continue;
+      std::map<int, std::size_t>::iterator iter = edges.find(t);
+      if (iter == edges.end()) {
+        Expr* position = new_expr(kCharClass);
+        iter = edges.insert(std::make_pair(t, automaton.positions.size())).first;
+        automaton.positions.push_back(position);
+        transitions[s].push_back(position);
+        targets.push_back(t);
+        tables.push_back(std::bitset<256>());
+      }
+      tables[iter->second].set(c);
+    }
+  }
+
+  for (std::size_t i = 0; i < automaton.positions.size(); i++) {
+    Expr* position = automaton.positions[i];
+    position->follow.insert(transitions[targets[i]].begin(), transitions[targets[i]].end());
+    if (dfa.accept(targets[i])) automaton.last.insert(position);
+    if (tables[i].count() == 1) {
+      position->type = kLiteral;
+      for (std::size_t c = 0; c < 256; c++) {
+        if (tables[i][c]) position->literal = c;
+      }
+    } else {
+      position->cc_table = intern(tables[i]);
+    }
+  }
+  automaton.first.insert(transitions[DFA::START].begin(), transitions[DFA::START].end());
+
+  Expr* e = new_expr(kAutomaton);
+  e->automaton = &automaton;
+  e->nullable = dfa.accept(DFA::START);
+  return e;
+}
+
+// the structural id of the tree, computed once per node: clones keep the
+// id of their original, so nested groups don't walk their subtree again.
+std::size_t Parser::shape(Expr* root)
+{
+  std::vector<Expr*> stack(1, root);
+
+  while (!stack.empty()) {
+    Expr* e = stack.back();
+    if (e->shape != 0) {
+      stack.pop_back();
+    } else if (e->lhs != NULL && e->lhs->shape == 0) {
+      stack.push_back(e->lhs);
+    } else if (e->rhs != NULL && e->rhs->shape == 0) {
+      stack.push_back(e->rhs);
+    } else {
+      std::size_t value = 0;
+      if (e->type == kLiteral) value = e->literal;
+      else if (e->type == kCharClass) value = reinterpret_cast<std::size_t>(e->cc_table);
+      Shape key(e->type, value, e->lhs == NULL ? 0 : e->lhs->shape, e->rhs == NULL ? 0 : e->rhs->shape);
+      e->shape = _shapes.insert(std::make_pair(key, _shapes.size() + 1)).first->second;
+      stack.pop_back();
+    }
+  }
+
+  return root->shape;
+}
+
+// a copy of the automaton with new positions (for repetitions). at parse
+// time follow sets only link positions of the same automaton.
+Parser::Automaton* Parser::clone_automaton(const Automaton& orig)
+{
+  std::map<Expr*, Expr*> clones;
+  _automata.resize(_automata.size() + 1);
+  Automaton& automaton = _automata.back();
+
+  for (std::size_t i = 0; i < orig.positions.size(); i++) {
+    Expr* position = orig.positions[i];
+    Expr* clone = new_expr(position->type);
+    clone->literal = position->literal;
+    clone->cc_table = position->cc_table;
+    clones[position] = clone;
+    automaton.positions.push_back(clone);
+  }
+  automaton.bound = orig.bound;
+
+  for (std::size_t i = 0; i < orig.positions.size(); i++) {
+    Expr* position = orig.positions[i];
+    for (std::set<Expr*>::const_iterator iter = position->follow.begin();
+         iter != position->follow.end(); ++iter) {
+      clones[position]->follow.insert(clones[*iter]);
+    }
+  }
+  for (std::set<Expr*>::const_iterator iter = orig.first.begin(); iter != orig.first.end(); ++iter) {
+    automaton.first.insert(clones[*iter]);
+  }
+  for (std::set<Expr*>::const_iterator iter = orig.last.begin(); iter != orig.last.end(); ++iter) {
+    automaton.last.insert(clones[*iter]);
+  }
+
+  return &automaton;
+}
+
+// TODO: advanced optimization for Power of Matrix.
+// Does anyone know good (multi-precision) matrix library?
+
+typedef mpz_class Value;
+
+class Exception: public std::out_of_range {
+ public:
+  Exception(const std::string& error): std::out_of_range(error) {}
+};
+
+class MPMatrix {
+ public:
+  // multiply() switches to Strassen-Winograd from this size and this
+  // average size of the entries (in limbs) on.
+  static const std::size_t kWinogradSize = 64;
+  static const std::size_t kWinogradLimbs = 32;
+  // products are computed in parallel from this size on.
+  static const std::size_t kParallelSize = 32;
+  MPMatrix(std::size_t i = 0): _size(i), m(_size*_size) {}
+  MPMatrix(std::size_t row, std::size_t col): _size(row), m(_size*_size) {}
+  MPMatrix(const MPMatrix &M) { *this = M; }
+  void resize(std::size_t n) { resize(n, n); }
+  void resize(std::size_t row, std::size_t col) { _size = row; m.resize(_size*_size); }
+  friend std::ostream& operator<<(std::ostream& stream, const MPMatrix& matrix);
+  std::size_t size() const { return _size; }
+  void clear();
+  void init();
+  void swap(MPMatrix &M) { m.swap(M.m); }
+  Value& operator()(std::size_t i, std::size_t j) { return m[i*_size+j]; }
+  const Value& operator()(std::size_t i, std::size_t j) const { return m[i*_size+j]; }
+  const Value& value(std::size_t i, std::size_t j) const { return m[i*_size+j]; }
+  MPMatrix& operator*=(const MPMatrix&);
+  std::size_t bytes() const;
+  std::size_t limbs() const;
+  std::vector<std::set<std::size_t> >& scc(std::vector<std::set<std::size_t> >&) const;
+  MPMatrix& sub_matrix(const std::set<std::size_t>&, MPMatrix&) const;
+  double frobenius_root() const;
+
+ private:
+  // for scc
+  void visit1(std::set<std::size_t>&, std::size_t, std::vector<std::size_t>&) const;
+  void visit2(std::set<std::size_t>&, std::size_t, std::set<std::size_t>&) const;
+
+  // fields
+  std::size_t _size;
+  std::vector<Value> m;
+};
+
+MPMatrix& multiply(const MPMatrix&, const MPMatrix&, MPMatrix&);
+MPMatrix& blocked_multiply(const MPMatrix&, const MPMatrix&, MPMatrix&);
+MPMatrix& winograd_multiply(const MPMatrix&, const MPMatrix&, MPMatrix&);
+
+class MPIdentityMatrix: public MPMatrix {
+ public:
+  MPIdentityMatrix(std::size_t n): MPMatrix(n, n)
+  {
+    for (std::size_t i = 0; i < n; i++) (*this)(i, i) = 1;
+  }
+};
+
+MPMatrix& MPMatrix::operator*=(const MPMatrix &M)
+{
+  MPMatrix tmp;
+  multiply(*this, M, tmp);
+  swap(tmp);
+  return *this;
+}
+
+// dst = A * B. the products of big entries dominate the cost, so large
+// matrices of large entries go to winograd_multiply(), which trades one of
+// the eight half-size products for a few additions; the rest (and the
+// leaves of the recursion) go to blocked_multiply(). the thresholds are
+// where the two cross over in test/bench.cc ("make bench").
+MPMatrix& multiply(const MPMatrix& A, const MPMatrix& B, MPMatrix& dst)
+{
+  if (&dst == &A || &dst == &B) {
+    MPMatrix tmp;
+    multiply(A, B, tmp);
+    dst.resize(A.size());
+    dst.swap(tmp);
+    return dst;
+  }
+
+  if (A.size() >= MPMatrix::kWinogradSize && A.limbs() + B.limbs() >= 2 * MPMatrix::kWinogradLimbs) {
+    return winograd_multiply(A, B, dst);
+  }
+  return blocked_multiply(A, B, dst);
+}
+
+// dst = A * B, blocked so that a tile of B stays in cache while the rows
+// of A run over it. the loops go i-k-j, so that both B and dst are read
+// along their rows, and each term is accumulated in place with mpz_addmul
+// (no temporary product). dst keeps its limbs across calls, so passing the
+// same dst again reuses them. dst must not be A or B.
+// the rows of dst are independent, so they are dealt out to
+// ThreadPool::shared() by blocks of rows, from MPMatrix::kParallelSize
+// states on (smaller products don't pay for the threads).
+class BlockedProduct: public ThreadPool::Task {
+ public:
+  static const std::size_t kBlock = 32;
+  BlockedProduct(const MPMatrix& A, const MPMatrix& B, MPMatrix& dst): _A(A), _B(B), _dst(dst) {}
+  void operator()(std::size_t begin, std::size_t end)
+  {
+    const std::size_t n = _A.size();
+    for (std::size_t kk = 0; kk < n; kk += kBlock) {
+      const std::size_t kend = std::min(kk + kBlock, n);
+      for (std::size_t jj = 0; jj < n; jj += kBlock) {
+        const std::size_t jend = std::min(jj + kBlock, n);
+        for (std::size_t i = begin; i < end; i++) {
+          for (std::size_t k = kk; k < kend; k++) {
+            if (sgn(_A(i, k)) == 0) continue;
+            mpz_srcptr a = _A(i, k).get_mpz_t();
+            for (std::size_t j = jj; j < jend; j++) {
+              mpz_addmul(_dst(i, j).get_mpz_t(), a, _B(k, j).get_mpz_t());
+            }
+          }
+        }
+      }
+    }
+  }
+ private:
+  const MPMatrix& _A;
+  const MPMatrix& _B;
+  MPMatrix& _dst;
+};
+
+MPMatrix& blocked_multiply(const MPMatrix& A, const MPMatrix& B, MPMatrix& dst)
+{
+  const std::size_t n = A.size();
+  dst.resize(n);
+  dst.clear();
+  BlockedProduct product(A, B, dst);
+  if (n < MPMatrix::kParallelSize) product(0, n);
+  else ThreadPool::shared().parallel_for(n, product, 4);
+
+  return dst;
+}
+
+// the h x h block of X at (row, col), zero-padded past the edges.
+void quadrant(const MPMatrix& X, std::size_t row, std::size_t col, std::size_t h, MPMatrix& Q)
+{
+  Q.resize(h);
+  for (std::size_t i = 0; i < h; i++) {
+    for (std::size_t j = 0; j < h; j++) {
+      if (row + i < X.size() && col + j < X.size()) Q(i, j) = X(row + i, col + j);
+      else Q(i, j) = 0;
+    }
+  }
+}
+
+// dst = A + B, dst = A - B (dst may be A or B)
+MPMatrix& add(const MPMatrix& A, const MPMatrix& B, MPMatrix& dst)
+{
+  dst.resize(A.size());
+  for (std::size_t i = 0; i < A.size(); i++) {
+    for (std::size_t j = 0; j < A.size(); j++) mpz_add(dst(i, j).get_mpz_t(), A(i, j).get_mpz_t(), B(i, j).get_mpz_t());
+  }
+  return dst;
+}
+
+MPMatrix& subtract(const MPMatrix& A, const MPMatrix& B, MPMatrix& dst)
+{
+  dst.resize(A.size());
+  for (std::size_t i = 0; i < A.size(); i++) {
+    for (std::size_t j = 0; j < A.size(); j++) mpz_sub(dst(i, j).get_mpz_t(), A(i, j).get_mpz_t(), B(i, j).get_mpz_t());
+  }
+  return dst;
+}
+
+// dst = A * B by one level of Strassen-Winograd (7 products and 15
+// additions of the halves), the products going back through multiply().
+// odd sizes are padded with a zero row and column. dst must not be A or B.
+MPMatrix& winograd_multiply(const MPMatrix& A, const MPMatrix& B, MPMatrix& dst)
+{
+  const std::size_t n = A.size(), h = (n + 1) / 2;
+  MPMatrix A11, A12, A21, A22, B11, B12, B21, B22;
+  quadrant(A, 0, 0, h, A11); quadrant(A, 0, h, h, A12);
+  quadrant(A, h, 0, h, A21); quadrant(A, h, h, h, A22);
+  quadrant(B, 0, 0, h, B11); quadrant(B, 0, h, h, B12);
+  quadrant(B, h, 0, h, B21); quadrant(B, h, h, h, B22);
+
+  dst.resize(n);
+  MPMatrix S, T, P1, P2, U;
+  multiply(A11, B11, P1);
+  multiply(A12, B21, P2);
+  add(P1, P2, U); // C11 = P1 + P2
+  for (std::size_t i = 0; i < h; i++) {
+    for (std::size_t j = 0; j < h; j++) dst(i, j) = U(i, j);
+  }
+
+  add(A21, A22, S);        // S1
+  subtract(B12, B11, T);   // T1
+  MPMatrix P5;
+  multiply(S, T, P5);      // P5 = S1 T1
+  subtract(S, A11, S);     // S2 = S1 - A11
+  subtract(B22, T, T);     // T2 = B22 - T1
+  multiply(S, T, P2);      // P6 = S2 T2
+  add(P1, P2, U);          // U2 = P1 + P6
+  subtract(A12, S, S);     // S4 = A12 - S2
+  subtract(T, B21, T);     // T4 = T2 - B21
+  MPMatrix P;
+  multiply(S, B22, P);     // P3 = S4 B22
+  multiply(A22, T, P1);    // P4 = A22 T4
+  subtract(A11, A21, S);   // S3
+  subtract(B22, B12, T);   // T3
+  multiply(S, T, P2);      // P7 = S3 T3
+  add(U, P2, U);           // U3 = U2 + P7
+  add(U, P5, T);           // C22 = U3 + P5
+  subtract(U, P1, S);      // C21 = U3 - P4
+  subtract(U, P2, U);      // U2 = U3 - P7
+  add(U, P5, U);           // U4 = U2 + P5
+  add(U, P, U);            // C12 = U4 + P3
+
+  for (std::size_t i = 0; i < h; i++) {
+    for (std::size_t j = 0; j < h; j++) {
+      if (h + j < n) dst(i, h + j) = U(i, j);
+      if (h + i < n) dst(h + i, j) = S(i, j);
+      if (h + i < n && h + j < n) dst(h + i, h + j) = T(i, j);
+    }
+  }
+
+  return dst;
+}
+
+// the memory held by the matrix, limbs included.
+std::size_t MPMatrix::bytes() const
+{
+  std::size_t bytes_ = sizeof(*this) + m.size() * sizeof(Value);
+  for (std::size_t i = 0; i < m.size(); i++) bytes_ += mpz_size(m[i].get_mpz_t()) * sizeof(mp_limb_t);
+  return bytes_;
+}
+
+// the average size of the entries, in limbs.
+std::size_t MPMatrix::limbs() const
+{
+  if (m.empty()) return 0;
+  std::size_t limbs_ = 0;
+  for (std::size_t i = 0; i < m.size(); i++) limbs_ += mpz_size(m[i].get_mpz_t());
+  return limbs_ / m.size();
+}
+
+void MPMatrix::clear()
+{
+  for (std::size_t i = 0; i < size(); i++) {
+    for (std::size_t j = 0; j < size(); j++) {
+      (*this)(i, j) = 0;
+    }
+  }
+}
+
+void MPMatrix::init()
+{
+  for (std::size_t i = 0; i < size(); i++) {
+    for (std::size_t j = 0; j < size(); j++) {
+      (*this)(i, j) = i == j ? 1 : 0;
+    }
+  }
+}
+
+
+std::vector<std::set<std::size_t> >& MPMatrix::scc(std::vector<std::set<std::size_t> >& sccs) const
+{
+  sccs.clear();
+  std::set<std::size_t> elem;
+  std::vector<std::size_t> num;
+
+  for (std::size_t i = 0; i < size(); i++) {
+    if (elem.find(i) == elem.end()) visit1(elem, i, num);
+  }
+  elem.clear();
+  for (std::vector<std::size_t>::reverse_iterator iter = num.rbegin();
+       iter != num.rend(); ++iter) {
+    std::set<std::size_t> scc_;
+    if (elem.find(*iter) == elem.end()) visit2(elem, *iter, scc_);
+    if (scc_.size() == 1 && value(*iter, *iter) == 0) continue;
+    if (!scc_.empty()) sccs.push_back(scc_);
+  }
+
+  return sccs;
+}
+
+void MPMatrix::visit1(std::set<std::size_t>& elem, std::size_t v, std::vector<std::size_t>& num) const
+{
+  // vertex numbering based on post-order
+  elem.insert(v);
+  for (std::size_t i = 0; i < size(); i++) {
+    if (value(v, i) != 0 && elem.find(i) == elem.end()) {
+      visit1(elem, i, num);
+    }
+  }
+  num.push_back(v);
+}
+
+void MPMatrix::visit2(std::set<std::size_t>& elem, std::size_t v, std::set<std::size_t>& scc_) const
 {
   // find scc of a given vertex v
   elem.insert(v);
   for (std::size_t i = 0; i < size(); i++) {
-    if (value(i, v) != 0 && elem.find(i) == elem.end()) {
-      visit2(elem, i, scc_);
+    if (value(i, v) != 0 && elem.find(i) == elem.end()) {
+      visit2(elem, i, scc_);
+    }
+  }
+  scc_.insert(v);
+}
+
+MPMatrix& MPMatrix::sub_matrix(const std::set<std::size_t>& elem, MPMatrix& dst) const
+{
+  dst.resize(elem.size());
+  int i = 0, j;
+
+  for (std::set<size_t>::iterator iter1 = elem.begin(); iter1 != elem.end(); ++iter1, i++) {
+    j = 0;
+    for (std::set<size_t>::iterator iter2 = elem.begin(); iter2 != elem.end(); ++iter2, j++) {
+      dst(i, j) = value(*iter1, *iter2);
+    }    
+  }
+
+  return dst;
+}
+
+std::ostream& operator<<(std::ostream& stream, const MPMatrix& matrix)
+{
+  for (std::size_t i = 0; i < matrix.size(); i++) {
+    stream << "{";
+    for (std::size_t j = 0; j < matrix.size(); j++) {
+      stream << matrix(i, j);
+      if (j != matrix.size() - 1) stream << ",";
+    }
+    stream << "}";
+    if (i != matrix.size() - 1) stream << ",";
+    stream << std::endl;
+  }
+  return stream;
+}
+
+class MPVector {
+ public:
+  // products are computed in parallel from this size on.
+  static const std::size_t kParallelSize = 128;
+  MPVector(std::size_t size = 0): _v(size) {}
+  friend std::ostream& operator<<(std::ostream& stream, const MPMatrix& matrix);  
+  void resize(std::size_t size) { _v.resize(size); }
+  std::size_t size() const { return _v.size(); }
+  Value& operator[](std::size_t i) { return _v[i]; }
+  const Value& operator[](std::size_t i) const { return _v[i]; }
+  void clear() { for (std::size_t i = 0; i < size(); i++) _v[i] = 0; }
+  void swap(MPVector& V) { _v.swap(V._v); }
+  MPVector& operator*=(const MPMatrix&);
+  static Value& inner_prod(const MPVector&, const MPVector&, Value&);
+  std::size_t bytes() const;
+  std::size_t limbs() const;
+ private:
+  // fields
+  std::vector<Value> _v;
+};
+
+// the entries [begin, end) of v * X.
+class VectorProduct: public ThreadPool::Task {
+ public:
+  VectorProduct(const std::vector<Value>& v, const MPMatrix& X, std::vector<Value>& dst): _v(v), _X(X), _dst(dst) {}
+  void operator()(std::size_t begin, std::size_t end)
+  {
+    for (std::size_t j = 0; j < _v.size(); j++) {
+      if (sgn(_v[j]) == 0) continue;
+      for (std::size_t i = begin; i < end; i++) {
+        mpz_addmul(_dst[i].get_mpz_t(), _v[j].get_mpz_t(), _X(j, i).get_mpz_t());
+      }
+    }
+  }
+ private:
+  const std::vector<Value>& _v;
+  const MPMatrix& _X;
+  std::vector<Value>& _dst;
+};
+
+MPVector& MPVector::operator*=(const MPMatrix &X)
+{
+  std::vector<Value> v(size());
+  VectorProduct product(_v, X, v);
+  if (size() < kParallelSize) product(0, size());
+  else ThreadPool::shared().parallel_for(size(), product, 16);
+  v.swap(_v);
+  
+  return *this;
+}
+
+Value& MPVector::inner_prod(const MPVector& V, const MPVector& W, Value& v)
+{
+  for (std::size_t i = 0; i < V.size(); i++) v += V[i] * W[i];
+  return v;
+}
+
+// the total size of the entries, in limbs.
+std::size_t MPVector::limbs() const
+{
+  std::size_t limbs_ = 0;
+  for (std::size_t i = 0; i < _v.size(); i++) limbs_ += mpz_size(_v[i].get_mpz_t());
+  return limbs_;
+}
+
+std::size_t MPVector::bytes() const
+{
+  std::size_t bytes_ = sizeof(*this) + _v.size() * sizeof(Value);
+  for (std::size_t i = 0; i < _v.size(); i++) bytes_ += mpz_size(_v[i].get_mpz_t()) * sizeof(mp_limb_t);
+  return bytes_;
+}
+
+std::ostream& operator<<(std::ostream& stream, const MPVector& vector)
+{
+  stream << "{";
+  for (std::size_t i = 0; i < vector.size(); i++) {
+    stream << vector[i] << ", ";
+  }
+  stream << "}" << std::endl;
+  return stream;
+}
+
+// rans::SparseMatrix is a matrix in compressed sparse rows (CSR) whose
+// entries are machine words, as the ones of adjacency matrices are (at
+// most the size of the alphabet). a product with it costs one small-by-big
+// multiply-add (mpz_addmul_ui) per nonzero entry instead of |D| big products
+// per entry of the result.
+class SparseMatrix {
+ public:
+  // see multiply(const SparseMatrix&, const MPVector&, MPVector&).
+  static const std::size_t kParallelLimbs = 1 << 16;
+  SparseMatrix(): _rows(1, 0), _norm(0) {}
+  explicit SparseMatrix(const MPMatrix&);
+  std::size_t size() const { return _rows.size() - 1; }
+  std::size_t nonzeros() const { return _columns.size(); }
+  // the nonzero entries of row i are [begin(i), end(i)).
+  std::size_t begin(std::size_t i) const { return _rows[i]; }
+  std::size_t end(std::size_t i) const { return _rows[i+1]; }
+  std::size_t column(std::size_t k) const { return _columns[k]; }
+  unsigned long value(std::size_t k) const { return _values[k]; }
+  // the largest column sum: no entry of v * X exceeds max(v) * norm().
+  const Value& norm() const { return _norm; }
+  std::size_t bytes() const;
+ private:
+  // fields
+  std::vector<std::size_t> _rows;
+  std::vector<std::size_t> _columns;
+  std::vector<unsigned long> _values;
+  Value _norm;
+};
+
+SparseMatrix::SparseMatrix(const MPMatrix& X): _rows(1, 0), _norm(0)
+{
+  for (std::size_t i = 0; i < X.size(); i++) {
+    for (std::size_t j = 0; j < X.size(); j++) {
+      if (sgn(X(i, j)) == 0) continue;
+      if (!X(i, j).fits_ulong_p()) throw "sparse matrix entry out of range";
+      _columns.push_back(j);
+      _values.push_back(X(i, j).get_ui());
+    }
+    _rows.push_back(_columns.size());
+  }
+  std::vector<Value> columns(X.size());
+  for (std::size_t k = 0; k < _columns.size(); k++) columns[_columns[k]] += _values[k];
+  for (std::size_t j = 0; j < columns.size(); j++) {
+    if (columns[j] > _norm) _norm = columns[j];
+  }
+}
+
+std::size_t SparseMatrix::bytes() const
+{
+  return sizeof(*this) + _rows.size() * sizeof(std::size_t)
+      + _columns.size() * (sizeof(std::size_t) + sizeof(unsigned long));
+}
+
+// dst = v * X
+MPVector& multiply(const MPVector& v, const SparseMatrix& X, MPVector& dst)
+{
+  dst.resize(X.size());
+  dst.clear();
+  for (std::size_t i = 0; i < X.size(); i++) {
+    if (sgn(v[i]) == 0) continue;
+    for (std::size_t k = X.begin(i); k < X.end(i); k++) {
+      mpz_addmul_ui(dst[X.column(k)].get_mpz_t(), v[i].get_mpz_t(), X.value(k));
+    }
+  }
+  return dst;
+}
+
+// the rows [begin, end) of X * v.
+class SparseProduct: public ThreadPool::Task {
+ public:
+  SparseProduct(const SparseMatrix& X, const MPVector& v, MPVector& dst): _X(X), _v(v), _dst(dst) {}
+  void operator()(std::size_t begin, std::size_t end)
+  {
+    for (std::size_t i = begin; i < end; i++) {
+      for (std::size_t k = _X.begin(i); k < _X.end(i); k++) {
+        mpz_addmul_ui(_dst[i].get_mpz_t(), _v[_X.column(k)].get_mpz_t(), _X.value(k));
+      }
+    }
+  }
+ private:
+  const SparseMatrix& _X;
+  const MPVector& _v;
+  MPVector& _dst;
+};
+
+// dst = X * v, in parallel once there are SparseMatrix::kParallelLimbs limbs
+// to multiply.
+MPVector& multiply(const SparseMatrix& X, const MPVector& v, MPVector& dst)
+{
+  dst.resize(X.size());
+  dst.clear();
+  SparseProduct product(X, v, dst);
+  if (X.size() < 2 || X.nonzeros() * (v.limbs() / X.size() + 1) < SparseMatrix::kParallelLimbs) product(0, X.size());
+  else ThreadPool::shared().parallel_for(X.size(), product, 8);
+  return dst;
+}
+
+// dst = A * X
+MPMatrix& multiply(const MPMatrix& A, const SparseMatrix& X, MPMatrix& dst)
+{
+  MPMatrix tmp(A.size(), A.size());
+  for (std::size_t i = 0; i < A.size(); i++) {
+    for (std::size_t j = 0; j < A.size(); j++) {
+      if (sgn(A(i, j)) == 0) continue;
+      for (std::size_t k = X.begin(j); k < X.end(j); k++) {
+        mpz_addmul_ui(tmp(i, X.column(k)).get_mpz_t(), A(i, j).get_mpz_t(), X.value(k));
+      }
+    }
+  }
+  dst.resize(A.size());
+  dst.swap(tmp);
+  return dst;
+}
+
+// dst = X * A
+MPMatrix& multiply(const SparseMatrix& X, const MPMatrix& A, MPMatrix& dst)
+{
+  MPMatrix tmp(A.size(), A.size());
+  for (std::size_t i = 0; i < X.size(); i++) {
+    for (std::size_t k = X.begin(i); k < X.end(i); k++) {
+      for (std::size_t j = 0; j < A.size(); j++) {
+        if (sgn(A(X.column(k), j)) == 0) continue;
+        mpz_addmul_ui(tmp(i, j).get_mpz_t(), A(X.column(k), j).get_mpz_t(), X.value(k));
+      }
+    }
+  }
+  dst.resize(A.size());
+  dst.swap(tmp);
+  return dst;
+}
+
+// rans::HybridVector is a vector that computes in machine words (128 bits
+// where the compiler has them) and moves to an MPVector once an operation
+// could overflow, which is checked from a bound on its entries rather than
+// on every addition. the vectors of val() for short texts never leave the
+// words, so never allocate limbs.
+class HybridVector {
+ public:
+#ifdef RANS_INT128
+  typedef unsigned __int128 Word;
+#else
+  typedef unsigned long Word;
+#endif
+  static const std::size_t kBits = sizeof(Word) * CHAR_BIT;
+  HybridVector(std::size_t size = 0): _words(size, 0), _max(0), _promoted(false) {}
+  std::size_t size() const { return _promoted ? _values.size() : _words.size(); }
+  bool promoted() const { return _promoted; }
+  void add(std::size_t, unsigned long);
+  void promote();
+  void swap(HybridVector&);
+  Value& inner_prod(const MPVector&, Value&) const;
+  static bool fits(const Value&, Word&);
+  static Value& value(Word, Value&);
+  friend HybridVector& multiply(const HybridVector&, const SparseMatrix&, HybridVector&);
+ private:
+  // fields
+  std::vector<Word> _words;
+  MPVector _values;
+  Word _max; // no entry of _words exceeds it
+  bool _promoted;
+};
+
+void HybridVector::add(std::size_t i, unsigned long n)
+{
+  if (!_promoted && _max > ~static_cast<Word>(0) - n) promote();
+  if (_promoted) {
+    _values[i] += n;
+  } else {
+    _words[i] += n;
+    if (_words[i] > _max) _max = _words[i];
+  }
+}
+
+void HybridVector::promote()
+{
+  if (_promoted) return;
+  _values.resize(_words.size());
+  for (std::size_t i = 0; i < _words.size(); i++) value(_words[i], _values[i]);
+  std::vector<Word>().swap(_words);
+  _promoted = true;
+}
+
+void HybridVector::swap(HybridVector& v)
+{
+  _words.swap(v._words);
+  _values.swap(v._values);
+  std::swap(_max, v._max);
+  std::swap(_promoted, v._promoted);
+}
+
+Value& HybridVector::inner_prod(const MPVector& v, Value& dst) const
+{
+  if (_promoted) return MPVector::inner_prod(_values, v, dst);
+
+  Word sum = 0;
+  Value tmp;
+  for (std::size_t i = 0; i < _words.size(); i++) {
+    if (sgn(v[i]) == 0) continue;
+    if (v[i] != 1 || sum > ~static_cast<Word>(0) - _words[i]) {
+      dst += value(_words[i], tmp) * v[i];
+    } else {
+      sum += _words[i];
+    }
+  }
+  dst += value(sum, tmp);
+  return dst;
+}
+
+// w = v, if v fits in a word.
+bool HybridVector::fits(const Value& v, Word& w)
+{
+  if (sgn(v) < 0 || mpz_sizeinbase(v.get_mpz_t(), 2) > kBits) return false;
+  w = 0;
+  for (std::size_t i = mpz_size(v.get_mpz_t()); i-- > 0; ) {
+    w = (w << (GMP_NUMB_BITS - 1)) << 1; // no shift by the full width when limbs are as wide as words
+    w |= mpz_getlimbn(v.get_mpz_t(), i);
+  }
+  return true;
+}
+
+Value& HybridVector::value(Word w, Value& v)
+{
+  if (w >> (sizeof(unsigned long) * CHAR_BIT - 1) == 0) {
+    v = static_cast<unsigned long>(w);
+    return v;
+  }
+  v = 0;
+  for (std::size_t shift = kBits; shift != 0; ) {
+    shift -= 32;
+    v <<= 32;
+    v += static_cast<unsigned long>((w >> shift) & 0xffffffffUL);
+  }
+  return v;
+}
+
+// dst = v * X, in words unless max(v) * X.norm() could overflow them.
+HybridVector& multiply(const HybridVector& v, const SparseMatrix& X, HybridVector& dst)
+{
+  HybridVector::Word norm;
+  if (!v._promoted && HybridVector::fits(X.norm(), norm)
+      && (norm == 0 || v._max <= ~static_cast<HybridVector::Word>(0) / norm)) {
+    dst._words.assign(X.size(), 0);
+    dst._values.resize(0);
+    dst._promoted = false;
+    for (std::size_t i = 0; i < X.size(); i++) {
+      if (v._words[i] == 0) continue;
+      for (std::size_t k = X.begin(i); k < X.end(i); k++) dst._words[X.column(k)] += v._words[i] * X.value(k);
+    }
+    dst._max = 0;
+    for (std::size_t j = 0; j < X.size(); j++) {
+      if (dst._words[j] > dst._max) dst._max = dst._words[j];
+    }
+    return dst;
+  }
+
+  std::vector<HybridVector::Word>().swap(dst._words);
+  dst._promoted = true;
+  if (v._promoted) {
+    multiply(v._values, X, dst._values);
+  } else {
+    HybridVector promoted(v);
+    promoted.promote();
+    multiply(promoted._values, X, dst._values);
+  }
+  return dst;
+}
+
+// returns Y = X^n by square-and-multiply, with O(|X|^3 log n)-s factor-wise
+// multiplications.
+MPMatrix& power(const MPMatrix& X, std::size_t n, MPMatrix& Y)
+{
+  if (n == 0) {
+    Y = MPIdentityMatrix(X.size());
+    return Y;
+  }
+
+  MPMatrix square(X), buffer;
+  bool first = true;
+  for (;;) {
+    if (n & 1) {
+      if (first) {
+        Y = square;
+      } else {
+        multiply(Y, square, buffer);
+        Y.swap(buffer);
+      }
+      first = false;
+    }
+    if ((n >>= 1) == 0) break;
+    multiply(square, square, buffer);
+    square.swap(buffer);
+  }
+
+  return Y;
+}
+
+// rans::PowerLadder caches the squares X, X^2, X^4, ..., X^(2^k) of a
+// matrix, so that X^n costs only a product per set bit of n, and callers
+// (count, amount, length_of and rep of the same RANS) share the squares.
+// the cache stops growing at max_bytes; larger squares are then
+// recomputed from the largest cached one on each use.
+class PowerLadder {
+ public:
+  static const std::size_t kDefaultBytes = 64 << 20;
+  PowerLadder(): _bytes(0), _max_bytes(0), _full(false) { pthread_mutex_init(&_mutex, NULL); }
+  ~PowerLadder() { pthread_mutex_destroy(&_mutex); }
+  void reset(const MPMatrix&, std::size_t max_bytes = kDefaultBytes);
+  std::size_t size() const { return _squares.empty() ? 0 : _squares.front().size(); }
+  std::size_t bytes() const { return _bytes; }
+  const MPMatrix& square(std::size_t k, MPMatrix& tmp) const;
+  MPMatrix& power(std::size_t n, MPMatrix& Y) const;
+ private:
+  //DISALLOW COPY AND ASSIGN
+  PowerLadder(const PowerLadder&);
+  void operator=(const PowerLadder&);
+  // fields
+  mutable std::deque<MPMatrix> _squares; // references stay valid on growth
+  SparseMatrix _sparse; // X, if its entries are machine words
+  mutable std::size_t _bytes;
+  std::size_t _max_bytes;
+  mutable bool _full;
+  mutable pthread_mutex_t _mutex;
+};
+
+void PowerLadder::reset(const MPMatrix& X, std::size_t max_bytes)
+{
+  _squares.assign(1, X);
+  try {
+    _sparse = SparseMatrix(X);
+  } catch (const char*) {
+    _sparse = SparseMatrix();
+  }
+  _bytes = X.bytes();
+  _max_bytes = max_bytes;
+  _full = false;
+}
+
+// X^(2^k), from the cache or (past its limit) computed into tmp.
+const MPMatrix& PowerLadder::square(std::size_t k, MPMatrix& tmp) const
+{
+  pthread_mutex_lock(&_mutex);
+  while (_squares.size() <= k && !_full) {
+    MPMatrix next;
+    if (_squares.size() == 1 && _sparse.size() == size()) multiply(_squares.back(), _sparse, next);
+    else multiply(_squares.back(), _squares.back(), next);
+    std::size_t bytes = next.bytes();
+    if (_bytes + bytes > _max_bytes) {
+      _full = true;
+    } else {
+      _bytes += bytes;
+      _squares.push_back(next);
+    }
+  }
+  std::size_t cached = _squares.size();
+  if (k < cached) {
+    const MPMatrix& square_ = _squares[k];
+    pthread_mutex_unlock(&_mutex);
+    return square_;
+  }
+  tmp = _squares.back();
+  pthread_mutex_unlock(&_mutex);
+
+  MPMatrix buffer;
+  for (std::size_t i = cached - 1; i < k; i++) {
+    multiply(tmp, tmp, buffer);
+    tmp.swap(buffer);
+  }
+  return tmp;
+}
+
+MPMatrix& PowerLadder::power(std::size_t n, MPMatrix& Y) const
+{
+  if (n == 0) {
+    Y = MPIdentityMatrix(size());
+    return Y;
+  }
+
+  MPMatrix tmp, buffer;
+  bool first = true;
+  for (std::size_t k = 0; n != 0; k++, n >>= 1) {
+    if ((n & 1) == 0) continue;
+    const MPMatrix& square_ = square(k, tmp);
+    if (first) {
+      Y = square_;
+    } else {
+      multiply(Y, square_, buffer);
+      Y.swap(buffer);
+    }
+    first = false;
+  }
+
+  return Y;
+}
+
+// rans::SuffixTable holds N[len] = X^len * accept_vector, the number of
+// acceptable suffixes of each length from each state, which is all rep()
+// needs to pick a symbol. rows are added on demand, a sparse product each,
+// and are shared by later calls. the table stops growing at max_bytes.
+class SuffixTable {
+ public:
+  SuffixTable(): _bytes(0), _max_bytes(0), _full(false) { pthread_mutex_init(&_mutex, NULL); }
+  ~SuffixTable() { pthread_mutex_destroy(&_mutex); }
+  void reset(const SparseMatrix&, const MPVector&, std::size_t max_bytes = PowerLadder::kDefaultBytes);
+  const MPVector* row(std::size_t length) const;
+  const std::vector<HybridVector::Word>* words(std::size_t length) const;
+  std::size_t bytes() const { return _bytes; }
+ private:
+  //DISALLOW COPY AND ASSIGN
+  SuffixTable(const SuffixTable&);
+  void operator=(const SuffixTable&);
+  void push(const MPVector&) const;
+  // fields
+  SparseMatrix _matrix;
+  mutable std::deque<MPVector> _rows; // pointers stay valid on growth
+  mutable std::deque<std::vector<HybridVector::Word> > _words; // the first rows, while they fit in words
+  mutable std::size_t _bytes;
+  std::size_t _max_bytes;
+  mutable bool _full;
+  mutable pthread_mutex_t _mutex;
+};
+
+void SuffixTable::reset(const SparseMatrix& X, const MPVector& accept, std::size_t max_bytes)
+{
+  _matrix = X;
+  _rows.clear();
+  _words.clear();
+  _bytes = accept.bytes();
+  push(accept);
+  _max_bytes = max_bytes;
+  _full = false;
+}
+
+// N[length], or NULL if the table can't grow that far.
+const MPVector* SuffixTable::row(std::size_t length) const
+{
+  pthread_mutex_lock(&_mutex);
+  while (_rows.size() <= length && !_full) {
+    MPVector next;
+    multiply(_matrix, _rows.back(), next);
+    std::size_t bytes = next.bytes();
+    if (_bytes + bytes > _max_bytes) {
+      _full = true;
+      break;
+    }
+    _bytes += bytes;
+    push(next);
+  }
+  const MPVector* row_ = length < _rows.size() ? &_rows[length] : NULL;
+  pthread_mutex_unlock(&_mutex);
+
+  return row_;
+}
+
+// N[length] in words, or NULL if it (or a shorter row) doesn't fit in them.
+const std::vector<HybridVector::Word>* SuffixTable::words(std::size_t length) const
+{
+  if (row(length) == NULL) return NULL;
+  pthread_mutex_lock(&_mutex);
+  const std::vector<HybridVector::Word>* words_ = length < _words.size() ? &_words[length] : NULL;
+  pthread_mutex_unlock(&_mutex);
+
+  return words_;
+}
+
+void SuffixTable::push(const MPVector& row_) const
+{
+  _rows.push_back(row_);
+  if (_words.size() + 1 != _rows.size()) return;
+  std::vector<HybridVector::Word> words_(row_.size());
+  for (std::size_t i = 0; i < row_.size(); i++) {
+    if (!HybridVector::fits(row_[i], words_[i])) return;
+  }
+  _words.push_back(words_);
+  _bytes += words_.size() * sizeof(HybridVector::Word);
+}
+
+// rans::Recurrence holds the shortest linear recurrence
+//   s[n] = c[1] s[n-1] + ... + c[L] s[n-L]
+// of s[n] = start * X^n * target. by Cayley-Hamilton L is at most the size
+// |D| of X, so Berlekamp-Massey (over the rationals; the coefficients come
+// out as integers, since the characteristic polynomial of X is monic) finds
+// it from the first 2|D| terms. term(n) is then x^n modulo the
+// characteristic polynomial of the recurrence (Kitamasa), O(L^2 log n)
+// products instead of the O(|D|^3 log n) of a matrix power. the recurrence
+// is found on the first call.
+class Recurrence {
+ public:
+  Recurrence(): _found(false) { pthread_mutex_init(&_mutex, NULL); }
+  ~Recurrence() { pthread_mutex_destroy(&_mutex); }
+  void reset(const SparseMatrix&, const MPVector&, const MPVector&);
+  std::size_t order() const { find(); return _coefficients.size(); }
+  const std::vector<Value>& coefficients() const { find(); return _coefficients; }
+  Value& term(std::size_t, Value&) const;
+  static void berlekamp_massey(const std::vector<Value>&, std::vector<Value>&);
+#ifdef RANS_INT128
+  static bool modular_berlekamp_massey(const std::vector<Value>&, std::vector<Value>&);
+#endif
+ private:
+  //DISALLOW COPY AND ASSIGN
+  Recurrence(const Recurrence&);
+  void operator=(const Recurrence&);
+  void find() const;
+  void multiply(const std::vector<Value>&, const std::vector<Value>&, std::vector<Value>&) const;
+#ifdef RANS_INT128
+  typedef unsigned long Word;
+  // the first n primes above 2^61.
+  static void primes(std::size_t, std::vector<Word>&);
+#endif
+  // fields
+  SparseMatrix _matrix;
+  MPVector _start;
+  MPVector _target;
+  mutable std::vector<Value> _coefficients; // c[1], ..., c[L]
+  mutable std::vector<Value> _terms; // s[0], ..., s[L-1]
+  mutable bool _found;
+  mutable pthread_mutex_t _mutex;
+};
+
+void Recurrence::reset(const SparseMatrix& X, const MPVector& start, const MPVector& target)
+{
+  _matrix = X;
+  _start = start;
+  _target = target;
+  _coefficients.clear();
+  _terms.clear();
+  _found = false;
+}
+
+void Recurrence::find() const
+{
+  pthread_mutex_lock(&_mutex);
+  if (!_found) {
+    std::vector<Value> terms(2 * _matrix.size() + 2);
+    MPVector v(_start), buffer;
+    for (std::size_t n = 0; n < terms.size(); n++) {
+      if (n > 0) {
+        rans::multiply(v, _matrix, buffer);
+        v.swap(buffer);
+      }
+      MPVector::inner_prod(v, _target, terms[n]);
+    }
+#ifdef RANS_INT128
+    if (!modular_berlekamp_massey(terms, _coefficients))
+#endif
+    berlekamp_massey(terms, _coefficients);
+    _terms.assign(terms.begin(), terms.begin() + _coefficients.size());
+    _found = true;
+  }
+  pthread_mutex_unlock(&_mutex);
+}
+
+// the shortest recurrence of the terms (c[1], ..., c[L]); they must hold
+// at least twice its order.
+void Recurrence::berlekamp_massey(const std::vector<Value>& terms, std::vector<Value>& coefficients)
+{
+  // C(x) = 1 + C[1] x + ... + C[L] x^L annihilates the terms; B is C before
+  // the last change of L, b the discrepancy then.
+  std::vector<mpq_class> C(1, 1), B(1, 1), T;
+  mpq_class b = 1, d, ratio;
+  std::size_t L = 0, m = 1;
+
+  for (std::size_t n = 0; n < terms.size(); n++) {
+    d = terms[n];
+    for (std::size_t i = 1; i <= L; i++) d += C[i] * terms[n-i];
+    if (sgn(d) == 0) {
+      m++;
+      continue;
+    }
+    ratio = d / b;
+    if (2 * L <= n) T = C;
+    if (C.size() < B.size() + m) C.resize(B.size() + m);
+    for (std::size_t i = 0; i < B.size(); i++) C[i+m] -= ratio * B[i];
+    if (2 * L <= n) {
+      L = n + 1 - L;
+      B.swap(T);
+      b = d;
+      m = 1;
+    } else {
+      m++;
+    }
+  }
+
+  coefficients.resize(L);
+  for (std::size_t i = 1; i <= L; i++) {
+    mpq_class c = i < C.size() ? mpq_class(-C[i]) : mpq_class(0);
+    if (c.get_den() != 1) throw "recurrence error: coefficients are not integers";
+    coefficients[i-1] = c.get_num();
+  }
+}
+
+#ifdef RANS_INT128
+void Recurrence::primes(std::size_t n, std::vector<Word>& dst)
+{
+  static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  static std::vector<Word> cache;
+
+  pthread_mutex_lock(&mutex);
+  if (cache.size() < n) {
+    Value p;
+    if (cache.empty()) mpz_ui_pow_ui(p.get_mpz_t(), 2, 61);
+    else p = cache.back();
+    while (cache.size() < n) {
+      mpz_nextprime(p.get_mpz_t(), p.get_mpz_t());
+      cache.push_back(p.get_ui());
+    }
+  }
+  dst.assign(cache.begin(), cache.begin() + n);
+  pthread_mutex_unlock(&mutex);
+}
+
+// berlekamp_massey() over the rationals is slow, as the terms are long.
+// this one runs it modulo 1, 2, 4, ... primes, reconstructs the (signed)
+// coefficients by the chinese remainder theorem, and returns once they
+// satisfy the terms exactly: a recurrence of order L <= terms.size() / 2
+// that does is the shortest one. false if none does up to 64 primes.
+bool Recurrence::modular_berlekamp_massey(const std::vector<Value>& terms, std::vector<Value>& coefficients)
+{
+  typedef unsigned __int128 Wide;
+  const std::size_t N = terms.size();
+
+  for (std::size_t count = 1; count <= 64; count *= 2) {
+    std::vector<Word> primes;
+    Recurrence::primes(count, primes);
+    std::vector<std::vector<Word> > residues(count);
+    std::size_t L = 0;
+
+    for (std::size_t p = 0; p < count; p++) {
+      const Word prime = primes[p];
+      std::vector<Word> s(N), C(1, 1), B(1, 1), T;
+      for (std::size_t n = 0; n < N; n++) s[n] = mpz_fdiv_ui(terms[n].get_mpz_t(), prime);
+      Word b = 1;
+      std::size_t l = 0, m = 1;
+      for (std::size_t n = 0; n < N; n++) {
+        Word d = s[n];
+        for (std::size_t i = 1; i <= l; i++) d = static_cast<Word>((d + static_cast<Wide>(C[i]) * s[n-i]) % prime);
+        if (d == 0) {
+          m++;
+          continue;
+        }
+        // ratio = d / b, b^-1 = b^(p-2)
+        Word inverse = 1, base = b;
+        for (Word e = prime - 2; e != 0; e >>= 1) {
+          if (e & 1) inverse = static_cast<Word>(static_cast<Wide>(inverse) * base % prime);
+          base = static_cast<Word>(static_cast<Wide>(base) * base % prime);
+        }
+        const Word ratio = static_cast<Word>(static_cast<Wide>(d) * inverse % prime);
+        if (2 * l <= n) T = C;
+        if (C.size() < B.size() + m) C.resize(B.size() + m, 0);
+        for (std::size_t i = 0; i < B.size(); i++) {
+          C[i+m] = static_cast<Word>((C[i+m] + prime - static_cast<Wide>(ratio) * B[i] % prime) % prime);
+        }
+        if (2 * l <= n) {
+          l = n + 1 - l;
+          B.swap(T);
+          b = d;
+          m = 1;
+        } else {
+          m++;
+        }
+      }
+      C.resize(l + 1, 0);
+      residues[p] = C;
+      L = std::max(L, l);
+    }
+
+    // primes dividing some discriminant may give a shorter recurrence; they
+    // are left out.
+    coefficients.assign(L, 0);
+    Value modulus = 1, c, inverse, half;
+    for (std::size_t p = 0; p < count; p++) {
+      if (residues[p].size() != L + 1) continue;
+      const Value prime(primes[p]);
+      mpz_invert(inverse.get_mpz_t(), modulus.get_mpz_t(), prime.get_mpz_t());
+      for (std::size_t i = 0; i < L; i++) {
+        // c[i+1] = -C[i+1]
+        c = (primes[p] - residues[p][i+1]) % primes[p];
+        c -= coefficients[i];
+        c *= inverse;
+        mpz_mod(c.get_mpz_t(), c.get_mpz_t(), prime.get_mpz_t());
+        coefficients[i] += modulus * c;
+      }
+      modulus *= prime;
+    }
+    half = modulus / 2;
+    for (std::size_t i = 0; i < L; i++) {
+      if (coefficients[i] > half) coefficients[i] -= modulus;
+    }
+
+    bool satisfied = 2 * L <= N;
+    Value sum;
+    for (std::size_t n = L; satisfied && n < N; n++) {
+      sum = 0;
+      for (std::size_t i = 1; i <= L; i++) mpz_addmul(sum.get_mpz_t(), coefficients[i-1].get_mpz_t(), terms[n-i].get_mpz_t());
+      satisfied = sum == terms[n];
+    }
+    if (satisfied) return true;
+  }
+
+  return false;
+}
+#endif
+
+// dst = a * b mod x^L - c[1] x^(L-1) - ... - c[L]
+void Recurrence::multiply(const std::vector<Value>& a, const std::vector<Value>& b, std::vector<Value>& dst) const
+{
+  const std::size_t L = _coefficients.size();
+  std::vector<Value> product(2 * L - 1);
+  for (std::size_t i = 0; i < L; i++) {
+    if (sgn(a[i]) == 0) continue;
+    for (std::size_t j = 0; j < L; j++) mpz_addmul(product[i+j].get_mpz_t(), a[i].get_mpz_t(), b[j].get_mpz_t());
+  }
+  for (std::size_t k = product.size() - 1; k >= L; k--) {
+    if (sgn(product[k]) == 0) continue;
+    for (std::size_t i = 1; i <= L; i++) {
+      mpz_addmul(product[k-i].get_mpz_t(), product[k].get_mpz_t(), _coefficients[i-1].get_mpz_t());
+    }
+  }
+  product.resize(L);
+  dst.swap(product);
+}
+
+Value& Recurrence::term(std::size_t n, Value& dst) const
+{
+  find();
+  const std::size_t L = _coefficients.size();
+  dst = 0;
+  if (L == 0) return dst;
+  if (n < L) return dst = _terms[n];
+
+  // r = x^n mod the characteristic polynomial, right-to-left.
+  std::vector<Value> r(L), square(L);
+  r[0] = 1;
+  if (L == 1) square[0] = _coefficients[0];
+  else square[1] = 1;
+  for (; n != 0; n >>= 1) {
+    if (n & 1) multiply(r, square, r);
+    if (n > 1) multiply(square, square, square);
+  }
+
+  for (std::size_t i = 0; i < L; i++) mpz_addmul(dst.get_mpz_t(), r[i].get_mpz_t(), _terms[i].get_mpz_t());
+  return dst;
+}
+
+// calculate maximum eigenvalue (frovenius root) using simple power method.
+double MPMatrix::frobenius_root() const
+{
+  MPVector start_vector(size()), prev_vector(size());
+  // (255/256)^10000 = 1.0049656577513434e-17, good precision
+  const std::size_t iteration = 10000;
+
+  // v * X as X^T * v, whose rows can go to different threads.
+  MPMatrix transposed(size());
+  for (std::size_t i = 0; i < size(); i++) {
+    for (std::size_t j = 0; j < size(); j++) transposed(i, j) = (*this)(j, i);
+  }
+  SparseMatrix X(transposed);
+  MPVector buffer(size());
+
+  for (std::size_t i = 0; i < size(); i++) {
+    start_vector[i] = 1;
+  }
+  for (std::size_t i = 0; i < iteration; i++) {
+    multiply(X, start_vector, buffer);
+    start_vector.swap(buffer);
+  }
+  for (std::size_t i = 0; i < size(); i++) {
+    prev_vector[i] = start_vector[i];
+  }
+  start_vector *= *this;
+  
+  Value value, prev_value;
+  MPVector::inner_prod(start_vector, start_vector, value);
+  MPVector::inner_prod(start_vector, prev_vector, prev_value);
+
+  mpf_class root = value;
+  root /= prev_value;
+  
+  return root.get_d();
+}
+
+// alphabet descriptors for BasicRANS. an alphabet has 'size' symbols, ranked
+// in the order of their indices, which stand for the bytes given by symbol().
+// index() is the inverse of symbol(), and returns -1 for other bytes.
+struct ByteAlphabet {
+  static const std::size_t size = 256;
+  static int index(unsigned char c) { return c; }
+  static unsigned char symbol(std::size_t i) { return i; }
+};
+
+struct DNAAlphabet {
+  static const std::size_t size = 4;
+  static int index(unsigned char c)
+  {
+    switch (c) {
+      case 'A': return 0;
+      case 'C': return 1;
+      case 'G': return 2;
+      case 'T': return 3;
+      default:  return -1;
+    }
+  }
+  static unsigned char symbol(std::size_t i) { return "ACGT"[i]; }
+};
+
+// lowercase hex digits only: the transitions of a regex on 'A'-'F' are
+// dropped, and texts with them are not accepted.
+struct HexAlphabet {
+  static const std::size_t size = 16;
+  static int index(unsigned char c)
+  {
+    if ('0' <= c && c <= '9') return c - '0';
+    if ('a' <= c && c <= 'f') return c - 'a' + 10;
+    return -1;
+  }
+  static unsigned char symbol(std::size_t i) { return "0123456789abcdef"[i]; }
+};
+
+// rans::BasicRANS ranks the texts over the Alphabet which the regex accepts.
+// the Alphabet is fixed at compile time, so the transition tables and the
+// loops of the ranking are sized to it instead of to 256 bytes.
+template <class Alphabet> class BasicRANS;
+typedef BasicRANS<ByteAlphabet> RANS;
+template <class Alphabet> class BasicUnionRANS;
+typedef BasicUnionRANS<ByteAlphabet> UnionRANS;
+
+template <class Alphabet>
+class BasicRANS {
+ public:
+  typedef rans::Exception Exception;
+  struct Spectrum {
+    Spectrum(double r, std::size_t m): root(m), multiplicity(m) {}
+    double root;
+    std::size_t multiplicity;
+  };
+  // CODEPOINT parses the regex as UTF8, but ranks texts as sequences of
+  // Unicode scalar values instead of symbols of the Alphabet (see
+  // initialize_codepoint_edges()). it requires the ByteAlphabet.
+  enum Encoding { ASCII = 0, UTF8 = 1, CODEPOINT = 2 };
+  typedef rans::Value Value;
+  // transitions are kept as sorted ranges of symbols (indices of the
+  // Alphabet, or codepoints).
+  struct Edge {
+    Edge(unsigned int f, unsigned int l, int n): first(f), last(l), next(n) {}
+    unsigned int first, last;
+    int next;
+  };
+  // the arguments of the (regex) constructor, for compile().
+  struct Spec {
+    Spec(const std::string& r, Encoding e = ASCII, bool f = false, bool i = false, bool m = true,
+         const Limits& l = Limits()):
+        regex(r), encoding(e), factorial(f), ignorecase(i), minimizing(m), limits(l) {}
+    std::string regex;
+    Encoding encoding;
+    bool factorial, ignorecase, minimizing;
+    Limits limits;
+  };
+  BasicRANS(const std::string&, Encoding = ASCII, bool = false, bool = false, bool = true,
+            const Limits& = Limits());
+  BasicRANS(const std::vector<std::string>&);
+  class Batch;
+  static Batch& compile(const std::vector<Spec>&, Batch&);
+  bool ok() const { return _ok; }
+  const std::string& error() const { return _error; }
+  bool accept(const std::string&) const;
+  Value& val(const std::string&, Value&) const;
+  Value val(const std::string& text) const { Value value; return val(text, value); }
+  Value& below(const std::string&, Value&) const;
+  Value below(const std::string& text) const { Value value; return below(text, value); }
+  std::string& rep(const Value&, std::string &) const;
+  std::string rep(const Value& value) const { std::string text; return rep(value, text); }
+  const DFA& dfa() const { return _dfa; }
+  Encoding encoding() const { return _encoding; }
+  const MPMatrix& adjacency_matrix() const { return _adjacency_matrix; }
+  const MPMatrix& extended_adjacency_matrix() const { return _extended_adjacency_matrix; }
+  const SparseMatrix& sparse_adjacency_matrix() const { return _sparse_adjacency_matrix; }
+  const std::vector<std::set<std::size_t> >& scc() const { return _scc; }
+  const std::vector<Edge>& edges(std::size_t state) const { return _edges[state]; }
+  std::size_t size() const { return _edges.size(); }
+  Value amount() const;
+  bool finite() const { return amount() != -1; }
+  bool infinite() const { return !finite(); }
+  Value amount(std::size_t length) const { return count(length, true); }
+  Value count(std::size_t length) const { return count(length, false); }
+  const Spectrum& spectrum() const;
+  // useful aliases for val & rep
+  Value& operator()(const std::string& text, Value& value) const { return val(text, value); }
+  Value operator()(const std::string& text) const { return val(text); }
+  std::string& operator()(const Value& value, std::string& text) const { return rep(value, text); }
+  std::string operator()(const Value& value) const { return rep(value); }
+  std::string compress(const std::string& text) const { std::string dst; return compress(text, dst); }
+  std::string decompress(const std::string& text) const { std::string dst; return decompress(text, dst); }
+  std::string& compress(const std::string&, std::string&) const;
+  std::string& decompress(const std::string&, std::string&) const;
+  double compression_ratio(int count = -1, const RANS& = baseBYTE) const;
+  double compression_ratio(const std::string& text, const RANS& = baseBYTE) const;
+  static const RANS baseBYTE;
+
+ private:
+  template <class> friend class BasicRANS;
+  template <class> friend class BasicUnionRANS;
+  class Compilation;
+  class Roots;
+  //DISALLOW COPY AND ASSIGN
+  BasicRANS(const BasicRANS&);
+  void operator=(const BasicRANS&);
+  void initialize(const Limits& = Limits());
+  void initialize_codepoint_edges();
+  const std::vector<Edge>& codepoint_suffixes(int, std::size_t,
+                                              std::map<std::pair<int, std::size_t>, std::vector<Edge> >&) const;
+  static void append_edge(std::vector<Edge>&, unsigned int, unsigned int, int);
+  bool decode(const std::string&, std::vector<unsigned int>&) const;
+  void encode(unsigned int, std::string&) const;
+  std::size_t length_of(const Value&) const;
+  bool word_rep(HybridVector::Word, std::string&) const;
+  Value count(std::size_t length, bool amount) const;
+  // fields
+  bool _ok;
+  std::string _error;
+  Encoding _encoding;
+  DFA _dfa;
+  std::vector<std::vector<Edge> > _edges;
+  std::vector<std::set<std::size_t> > _scc;
+  mutable Spectrum _spectrum;
+  const int _match_epsilon;
+  MPMatrix _adjacency_matrix;
+  MPMatrix _extended_adjacency_matrix;
+  PowerLadder _powers; // of the adjacency matrix
+  PowerLadder _extended_powers;
+  SparseMatrix _sparse_adjacency_matrix;
+  SuffixTable _suffixes;
+  Recurrence _counts; // of count(length)
+  Recurrence _amounts; // of amount(length)
+  int _extended_state;
+  MPVector _start_vector;
+  MPVector _accept_vector;
+};
+
+template <class Alphabet>
+BasicRANS<Alphabet>::BasicRANS(const std::string &regex, Encoding enc, bool factorial, bool ignorecase, bool minimizing,
+                               const Limits& limits):
+    _ok(true), _encoding(enc),
+    _dfa(regex, enc == ASCII ? rans::ASCII : rans::UTF8, minimizing, factorial, ignorecase, limits),
+    _spectrum(0, 0),
+    _match_epsilon(_dfa.accept(DFA::START) ? 1 : 0)
+{
+  initialize(limits);
+}
+
+// ANS on a finite language given as a list of words (a dictionary).
+// the minimal DFA is built directly from the words, see rans::DAWG.
+template <class Alphabet>
+BasicRANS<Alphabet>::BasicRANS(const std::vector<std::string>& words):
+    _ok(true), _encoding(ASCII), _dfa(words),
+    _spectrum(0, 0),
+    _match_epsilon(_dfa.accept(DFA::START) ? 1 : 0)
+{
+  initialize();
+}
+
+// the results of compile(), which owns them: the RANS of each spec, or
+// (if it is not ok(), or its construction threw) the error instead.
+template <class Alphabet>
+class BasicRANS<Alphabet>::Batch {
+ public:
+  Batch() {}
+  ~Batch() { clear(); }
+  std::size_t size() const { return _results.size(); }
+  // whether the spec compiled, also after its RANS is released.
+  bool ok(std::size_t i) const { return _errors[i].empty(); }
+  bool released(std::size_t i) const { return ok(i) && _results[i] == NULL; }
+  const std::string& error(std::size_t i) const { return _errors[i]; }
+  const BasicRANS& operator[](std::size_t i) const { return *_results[i]; }
+  // hands the RANS over to the caller, who deletes it.
+  BasicRANS* release(std::size_t i) { BasicRANS* rans = _results[i]; _results[i] = NULL; return rans; }
+  void clear();
+ private:
+  friend class BasicRANS;
+  //DISALLOW COPY AND ASSIGN
+  Batch(const Batch&);
+  void operator=(const Batch&);
+  // fields
+  std::vector<BasicRANS*> _results;
+  std::vector<std::string> _errors;
+};
+
+template <class Alphabet>
+void BasicRANS<Alphabet>::Batch::clear()
+{
+  for (std::size_t i = 0; i < _results.size(); i++) delete _results[i];
+  _results.clear();
+  _errors.clear();
+}
+
+template <class Alphabet>
+class BasicRANS<Alphabet>::Compilation: public ThreadPool::Task {
+ public:
+  Compilation(const std::vector<Spec>& specs, std::vector<BasicRANS*>& results, std::vector<std::string>& errors):
+      _specs(specs), _results(results), _errors(errors) {}
+  void operator()(std::size_t begin, std::size_t end)
+  {
+    for (std::size_t i = begin; i < end; i++) {
+      const Spec& spec = _specs[i];
+      try {
+        BasicRANS* rans = new BasicRANS(spec.regex, spec.encoding, spec.factorial, spec.ignorecase,
+                                        spec.minimizing, spec.limits);
+        if (rans->ok()) {
+          _results[i] = rans;
+        } else {
+          _errors[i] = rans->error().empty() ? "rans construct error" : rans->error();
+          delete rans;
+        }
+      } catch (const char* error) {
+        _errors[i] = std::string("rans construct error: ") + error;
+      } catch (const std::bad_alloc&) {
+        _errors[i] = "rans construct error: out of memory";
+      } catch (const std::exception& e) {
+        _errors[i] = std::string("rans construct error: ") + e.what();
+      } catch (...) {
+        _errors[i] = "rans construct error: unknown exception";
+      }
+    }
+  }
+ private:
+  const std::vector<Spec>& _specs;
+  std::vector<BasicRANS*>& _results;
+  std::vector<std::string>& _errors;
+};
+
+// compile() builds a RANS for each spec, in parallel on the shared
+// ThreadPool (their own constructions then run inline). a bad spec doesn't
+// fail the batch: errors, thrown or not, are kept per spec.
+template <class Alphabet>
+typename BasicRANS<Alphabet>::Batch& BasicRANS<Alphabet>::compile(const std::vector<Spec>& specs, Batch& batch)
+{
+  batch.clear();
+  batch._results.assign(specs.size(), NULL);
+  batch._errors.assign(specs.size(), std::string());
+  Compilation compilation(specs, batch._results, batch._errors);
+  ThreadPool::shared().parallel_for(specs.size(), compilation, 1);
+  return batch;
+}
+
+template <class Alphabet>
+void BasicRANS<Alphabet>::initialize(const Limits& limits)
+{
+  if (!_dfa.ok()) {
+    _ok = false;
+    _error = _dfa.error();
+    return;
+  }
+
+  if (_encoding == CODEPOINT) {
+    if (Alphabet::size != ByteAlphabet::size) {
+      _ok = false;
+      _error = "codepoint encoding requires the byte alphabet.";
+      return;
+    }
+    initialize_codepoint_edges();
+  } else {
+    // bytes out of the Alphabet are dropped; the DFA itself is byte-level.
+    _edges.resize(_dfa.size());
+    _accept_vector.resize(_dfa.size());
+    for (std::size_t i = 0; i < _dfa.size(); i++) {
+      if (_dfa.accept(i)) _accept_vector[i] = 1;
+      for (std::size_t a = 0; a < Alphabet::size; a++) {
+        int next = _dfa[i][Alphabet::symbol(a)];
+        if (next != DFA::REJECT) append_edge(_edges[i], a, a, next);
+      }
+    }
+  }
+
+  // both (dense) matrices, before allocating them.
+  if (limits.max_bytes != 0 && 2 * (size() + 1) * (size() + 1) * sizeof(Value) > limits.max_bytes) {
+    _ok = false;
+    _error = "rans construct error: memory limit exceeded";
+    return;
+  }
+
+  _extended_state = size();
+  _adjacency_matrix.resize(size(), size());
+  _extended_adjacency_matrix.resize(size()+1, size()+1);
+  _start_vector.resize(size());
+  _start_vector[DFA::START] = 1;
+
+  for (std::size_t i = 0; i < size(); i++) {
+    for (std::size_t j = 0; j < _edges[i].size(); j++) {
+      const Edge& e = _edges[i][j];
+      unsigned long n = e.last - e.first + 1;
+      _adjacency_matrix(i, e.next) += n;
+      _extended_adjacency_matrix(i, e.next) += n;
+      if (_accept_vector[e.next] != 0) {
+        _extended_adjacency_matrix(i, _extended_state) += n;
+      }
     }
   }
-  scc_.insert(v);
+
+  _adjacency_matrix.scc(_scc);
+  _extended_adjacency_matrix(_extended_state, _extended_state) = 1;
+
+  // the ladders and the suffix table share the memory limit of the construction.
+  const std::size_t max_bytes = limits.max_bytes != 0 ? limits.max_bytes : PowerLadder::kDefaultBytes;
+  _powers.reset(_adjacency_matrix, max_bytes / 4);
+  _extended_powers.reset(_extended_adjacency_matrix, max_bytes / 4);
+
+  _sparse_adjacency_matrix = SparseMatrix(_adjacency_matrix);
+  _suffixes.reset(_sparse_adjacency_matrix, _accept_vector, max_bytes / 2);
+  _counts.reset(_sparse_adjacency_matrix, _start_vector, _accept_vector);
+  MPVector start(size()+1), target(size()+1);
+  start[DFA::START] = 1;
+  target[_extended_state] = 1;
+  _amounts.reset(SparseMatrix(_extended_adjacency_matrix), start, target);
 }
 
-MPMatrix& MPMatrix::sub_matrix(const std::set<std::size_t>& elem, MPMatrix& dst) const
+template <class Alphabet>
+void BasicRANS<Alphabet>::append_edge(std::vector<Edge>& edges, unsigned int first, unsigned int last, int next)
 {
-  dst.resize(elem.size());
-  int i = 0, j;
+  if (!edges.empty() && edges.back().next == next && edges.back().last + 1 == first) {
+    edges.back().last = last;
+  } else {
+    edges.push_back(Edge(first, last, next));
+  }
+}
 
-  for (std::set<size_t>::iterator iter1 = elem.begin(); iter1 != elem.end(); ++iter1, i++) {
-    j = 0;
-    for (std::set<size_t>::iterator iter2 = elem.begin(); iter2 != elem.end(); ++iter2, j++) {
-      dst(i, j) = value(*iter1, *iter2);
-    }    
+// in CODEPOINT mode the alphabet is the Unicode scalar values. the states of
+// the ranking automaton are the DFA states reached on codepoint boundaries,
+// and every (valid, shortest form) UTF-8 path from one to another becomes a
+// codepoint edge; intermediate states disappear. so the matrices count
+// codepoints, and val()/rep() take one step per codepoint instead of per byte.
+// byte paths which don't spell valid UTF-8 are not part of the language.
+template <class Alphabet>
+void BasicRANS<Alphabet>::initialize_codepoint_edges()
+{
+  static const unsigned char lead_mask[] = { 0, 0x7F, 0x1F, 0x0F, 0x07 };
+  std::map<std::pair<int, std::size_t>, std::vector<Edge> > memo;
+  std::vector<int> id(_dfa.size(), DFA::REJECT), states(1, DFA::START);
+  id[DFA::START] = 0;
+
+  for (std::size_t i = 0; i < states.size(); i++) {
+    const DFA::State& state = _dfa[states[i]];
+    std::vector<Edge> edges; // targets are DFA states here.
+
+    for (unsigned int c = 0; c < 0x80; c++) {
+      if (state[c] != DFA::REJECT) append_edge(edges, c, c, state[c]);
+    }
+    for (unsigned int lead = 0xC2; lead <= 0xF4; lead++) {
+      unsigned char lo, hi;
+      if (state[lead] == DFA::REJECT) continue;
+      utf8_second_byte_range(lead, lo, hi);
+      const std::size_t len = utf8_byte_length(lead);
+      const DFA::State& second = _dfa[state[lead]];
+
+      for (unsigned int c = lo; c <= hi; c++) {
+        if (second[c] == DFA::REJECT) continue;
+        unsigned int base = ((lead & lead_mask[len]) << (6 * (len - 1))) | ((c & 0x3F) << (6 * (len - 2)));
+        const std::vector<Edge>& suffixes = codepoint_suffixes(second[c], len - 2, memo);
+        for (std::size_t j = 0; j < suffixes.size(); j++) {
+          append_edge(edges, base + suffixes[j].first, base + suffixes[j].last, suffixes[j].next);
+        }
+      }
+    }
+
+    for (std::size_t j = 0; j < edges.size(); j++) {
+      if (id[edges[j].next] == DFA::REJECT) {
+        id[edges[j].next] = states.size();
+        states.push_back(edges[j].next);
+      }
+      edges[j].next = id[edges[j].next];
+    }
+    _edges.push_back(edges);
   }
 
-  return dst;
+  _accept_vector.resize(states.size());
+  for (std::size_t i = 0; i < states.size(); i++) {
+    if (_dfa.accept(states[i])) _accept_vector[i] = 1;
+  }
 }
 
-std::ostream& operator<<(std::ostream& stream, const MPMatrix& matrix)
+// the DFA states reached from the given state by 'length' continuation
+// bytes, as ranges of the values (0 <= v < 64^length) of those bytes.
+template <class Alphabet>
+const std::vector<typename BasicRANS<Alphabet>::Edge>&
+BasicRANS<Alphabet>::codepoint_suffixes(int state, std::size_t length,
+                                        std::map<std::pair<int, std::size_t>, std::vector<Edge> >& memo) const
 {
-  for (std::size_t i = 0; i < matrix.size(); i++) {
-    stream << "{";
-    for (std::size_t j = 0; j < matrix.size(); j++) {
-      stream << matrix(i, j);
-      if (j != matrix.size() - 1) stream << ",";
+  std::pair<int, std::size_t> key(state, length);
+  typename std::map<std::pair<int, std::size_t>, std::vector<Edge> >::iterator iter = memo.find(key);
+  if (iter != memo.end()) return iter->second;
+
+  std::vector<Edge> suffixes;
+  if (length == 0) {
+    suffixes.push_back(Edge(0, 0, state));
+  } else {
+    for (unsigned int c = 0x80; c <= 0xBF; c++) {
+      int next = _dfa[state][c];
+      if (next == DFA::REJECT) continue;
+      unsigned int base = (c & 0x3F) << (6 * (length - 1));
+      const std::vector<Edge>& rest = codepoint_suffixes(next, length - 1, memo);
+      for (std::size_t j = 0; j < rest.size(); j++) {
+        append_edge(suffixes, base + rest[j].first, base + rest[j].last, rest[j].next);
+      }
     }
-    stream << "}";
-    if (i != matrix.size() - 1) stream << ",";
-    stream << std::endl;
   }
-  return stream;
+
+  return memo[key] = suffixes;
 }
 
-class MPVector {
- public:
-  MPVector(std::size_t size = 0): _v(size) {}
-  friend std::ostream& operator<<(std::ostream& stream, const MPMatrix& matrix);  
-  void resize(std::size_t size) { _v.resize(size); }
-  std::size_t size() const { return _v.size(); }
-  Value& operator[](std::size_t i) { return _v[i]; }
-  const Value& operator[](std::size_t i) const { return _v[i]; }
-  void clear() { for (std::size_t i = 0; i < size(); i++) _v[i] = 0; }
-  MPVector& operator*=(const MPMatrix&);
-  static Value& inner_prod(const MPVector&, const MPVector&, Value&);
- private:
-  // fields
-  std::vector<Value> _v;
-};
+// split the text into symbols: indices of the Alphabet, or codepoints in
+// CODEPOINT mode (returns false on bytes out of the alphabet, or invalid UTF-8).
+template <class Alphabet>
+bool BasicRANS<Alphabet>::decode(const std::string& text, std::vector<unsigned int>& symbols) const
+{
+  const unsigned char* s = reinterpret_cast<const unsigned char*>(text.data());
+  const unsigned char* end = s + text.length();
+  symbols.clear();
+
+  if (_encoding != CODEPOINT) {
+    symbols.resize(end - s);
+    for (std::size_t i = 0; s < end; s++, i++) {
+      int a = Alphabet::index(*s);
+      if (a < 0) return false;
+      symbols[i] = a;
+    }
+    return true;
+  }
 
-MPVector& MPVector::operator*=(const MPMatrix &X)
+  while (s < end) {
+    std::size_t len = utf8_byte_length(*s);
+    unsigned char lo, hi;
+    if (len == 0 || static_cast<std::size_t>(end - s) < len) return false;
+    if (len > 1) {
+      if (!utf8_second_byte_range(*s, lo, hi) || *(s+1) < lo || *(s+1) > hi) return false;
+      if (!is_valid_utf8_sequence(s)) return false;
+    }
+    symbols.push_back(utf8_decode(s));
+    s += len;
+  }
+
+  return true;
+}
+
+template <class Alphabet>
+void BasicRANS<Alphabet>::encode(unsigned int symbol, std::string& text) const
 {
-  std::vector<Value> v(size());
-  for (std::size_t i = 0; i < size(); i++) {
-    for (std::size_t j = 0; j < size(); j++) {
-      v[i] += _v[j] * X(j, i);
+  if (_encoding == CODEPOINT) {
+    unsigned char bytes[4];
+    text.append(bytes, bytes + utf8_encode(symbol, bytes));
+  } else {
+    text.append(1, Alphabet::symbol(symbol));
+  }
+}
+
+template <class Alphabet>
+bool BasicRANS<Alphabet>::accept(const std::string& text) const
+{
+  if (_encoding != CODEPOINT && Alphabet::size == ByteAlphabet::size) return _dfa.accept(text);
+
+  std::vector<unsigned int> symbols;
+  if (!decode(text, symbols)) return false;
+
+  int state = DFA::START;
+  for (std::size_t i = 0; state != DFA::REJECT && i < symbols.size(); i++) {
+    const std::vector<Edge>& edges = _edges[state];
+    state = DFA::REJECT;
+    for (std::size_t j = 0; j < edges.size() && edges[j].first <= symbols[i]; j++) {
+      if (symbols[i] <= edges[j].last) state = edges[j].next;
     }
   }
-  v.swap(_v);
+
+  return state != DFA::REJECT && _accept_vector[state] != 0;
+}
+
+// val(), which caliculates the value corresponds given text, is fundamental function of ANS.
+// val() is bijection: L -> N where L is set of acceptable string defined by
+// regular expression (DFA), and N is natural number (include 0).
+// (inverse function of this is rep())
+//
+// This implementation runs in time O(n * |E|) where n is the length of the text
+// and |E| is the number of transitions (pairs of states) of the DFA, each a
+// small-by-big multiply-add (see SparseMatrix).
+//
+// val() throws exception when text is not acceptable.
+// Therefore caller should assure that text is acceptable when calling this function.
+// caller could check like as: "if(accept(text)) val(text, value);".
+template <class Alphabet>
+Value& BasicRANS<Alphabet>::val(const std::string& text, Value& value) const
+{
+  if (!accept(text)) throw Exception("invalid text: text is not acceptable.");
+  return below(text, value);
+}
+
+// below() counts the acceptable texts which are smaller than the given
+// text (in shortlex order), which need not be acceptable itself. it is
+// val() of acceptable texts. see BasicUnionRANS.
+template <class Alphabet>
+Value& BasicRANS<Alphabet>::below(const std::string& text, Value& value) const
+{
+  int state = DFA::START;
+  value = 0;
+  HybridVector paths(size()), buffer;
+  std::vector<unsigned int> symbols;
+  if (!decode(text, symbols)) throw Exception("invalid text: text is not acceptable.");
+
+  for (std::size_t i = 0; i < symbols.size(); i++) {
+    paths.add(DFA::START, 1);
+    if (state != DFA::REJECT) {
+      const std::vector<Edge>& edges = _edges[state];
+      state = DFA::REJECT;
+      for (std::size_t j = 0; j < edges.size() && edges[j].first <= symbols[i]; j++) {
+        if (edges[j].last < symbols[i]) {
+          paths.add(edges[j].next, edges[j].last - edges[j].first + 1);
+        } else {
+          paths.add(edges[j].next, symbols[i] - edges[j].first);
+          state = edges[j].next;
+        }
+      }
+    }
+    if (i < symbols.size() - 1) {
+      multiply(paths, _sparse_adjacency_matrix, buffer);
+      paths.swap(buffer);
+    }
+  }
+
+  paths.inner_prod(_accept_vector, value);
   
-  return *this;
+  return value;
 }
 
-Value& MPVector::inner_prod(const MPVector& V, const MPVector& W, Value& v)
+// rep(), which caliculates the text corresponds given value, is fundamental function of ANS.
+// rep() is bijection: N -> L where and N is natural number (include 0) and L is
+// set of acceptable string defined by regular expression (DFA).
+// (inverse function of this is val())
+//
+// This implementation runs in time roughly O(n |E|) big additions where n is the
+// length of text and |E| is the number of transitions of the DFA, as the counts
+// of suffixes come from the SuffixTable. past its memory limit, they are
+// computed by matrix powers, in time roughly O(n log n |D|^3) where |D| is the
+// size of(number of states of) DFA.
+//
+// This will Throw exception when there exists no text s.t. val(text) == value.
+// Therefore caller should assure that there exists a correspoding text when
+// calling this function. but don't worry, this condition is always true if caller
+// got the value via val() just like: "value = val(text)"
+template <class Alphabet>
+std::string& BasicRANS<Alphabet>::rep(const Value& value, std::string& text) const
 {
-  for (std::size_t i = 0; i < V.size(); i++) v += V[i] * W[i];
-  return v;
+  if (value < 0) throw Exception("invalid value: correspoinding text does not exists.");
+  HybridVector::Word word;
+  if (HybridVector::fits(value, word) && word_rep(word, text)) return text;
+  
+  MPMatrix tmpM(size(), size());
+  int state = DFA::START;
+  Value value_ = value, val, block, offset;
+  std::size_t length = length_of(value_);
+  if (length > 0 && _suffixes.row(length - 1) != NULL) {
+    for (std::size_t l = 0; l < length; l++) value_ -= (*_suffixes.row(l))[DFA::START];
+  } else if (length > 0) {
+    value_ -= count(length - 1, true);
+  }
+  text = "";
+
+  while (length-- != 0) {
+    const MPVector* suffixes = _suffixes.row(length);
+    if (suffixes == NULL) _powers.power(length, tmpM);
+    const std::vector<Edge>& edges = _edges[state];
+
+    for (std::size_t j = 0; j < edges.size(); j++) {
+      // every symbol of an edge leads to the same state, so to the
+      // same number 'val' of acceptable suffixes.
+      if (suffixes != NULL) {
+        val = (*suffixes)[edges[j].next];
+      } else {
+        val = 0;
+        for (std::size_t i = 0; i < size(); i++) {
+          if (_accept_vector[i] != 0) val += tmpM(edges[j].next, i);
+        }
+      }
+      block = val * (edges[j].last - edges[j].first + 1);
+
+      if (value_ < block) {
+        offset = value_ / val;
+        encode(edges[j].first + offset.get_ui(), text);
+        state = edges[j].next;
+        value_ -= offset * val;
+        break;
+      }
+      value_ -= block;
+    }
+  }
+
+  return text;
 }
 
-std::ostream& operator<<(std::ostream& stream, const MPVector& vector)
+// rep() of a value that fits in a word, from the rows of the suffix table
+// that do too (it returns false when they run out before the length of
+// the text is found).
+template <class Alphabet>
+bool BasicRANS<Alphabet>::word_rep(HybridVector::Word value, std::string& text) const
 {
-  stream << "{";
-  for (std::size_t i = 0; i < vector.size(); i++) {
-    stream << vector[i] << ", ";
+  typedef HybridVector::Word Word;
+  const std::vector<Word>* suffixes;
+  std::size_t length = 0;
+  for (; ; length++) {
+    if ((suffixes = _suffixes.words(length)) == NULL) return false;
+    if ((*suffixes)[DFA::START] > value) break;
+    value -= (*suffixes)[DFA::START];
+    if (length > size()) {
+      bool dead = true;
+      for (std::size_t i = 0; dead && i < size(); i++) dead = (*suffixes)[i] == 0;
+      if (dead) throw Exception("invalid value: correspoinding text does not exists.");
+    }
   }
-  stream << "}" << std::endl;
-  return stream;
+
+  int state = DFA::START;
+  text = "";
+  while (length-- != 0) {
+    suffixes = _suffixes.words(length);
+    const std::vector<Edge>& edges = _edges[state];
+
+    for (std::size_t j = 0; j < edges.size(); j++) {
+      const Word val = (*suffixes)[edges[j].next];
+      const Word width = edges[j].last - edges[j].first + 1;
+      if (val != 0 && value / val < width) {
+        const Word offset = value / val;
+        encode(edges[j].first + static_cast<unsigned int>(offset), text);
+        state = edges[j].next;
+        value -= offset * val;
+        break;
+      }
+      value -= val * width;
+    }
+  }
+
+  return true;
 }
 
-// returns Y = X^n, with O(|X|^3 log n)-s factor-wise multiplications.
-// TODO: It seems more optimizable using linear algebraic techniques.
-MPMatrix& power(const MPMatrix& X, std::size_t n, MPMatrix& Y)
+template <class Alphabet>
+std::size_t BasicRANS<Alphabet>::length_of(const Value& value) const
 {
-  if (n == 0) Y = MPIdentityMatrix(X.size());
-  else Y = X;
+  if (value < _match_epsilon) return 0;
 
-  std::size_t i = 1;
-  while ((i *= 2) <= n) Y *= Y;
-  for (i /= 2; i < n; i++) Y *= X;
+  // the lengths of the suffix table, one row at a time.
+  Value sum;
+  for (std::size_t l = 0; ; l++) {
+    const MPVector* suffixes = _suffixes.row(l);
+    if (suffixes == NULL) break;
+    sum += (*suffixes)[DFA::START];
+    if (sum > value) return l;
+    if (l > size()) {
+      bool dead = true;
+      for (std::size_t i = 0; dead && i < size(); i++) dead = (*suffixes)[i] == 0;
+      // no texts longer than l-1, so the value has no text.
+      if (dead) throw Exception("invalid value: correspoinding text does not exists.");
+    }
+  }
 
-  return Y;
+  // the first 2^k whose amount exceeds the value, then binary lifting
+  // of the START row: the longest length whose amount doesn't.
+  MPMatrix tmpM;
+  Value amount_, prev;
+  std::size_t k = 0;
+  while ((amount_ = _extended_powers.square(k, tmpM)(DFA::START, _extended_state)) + _match_epsilon <= value) {
+    if (k > 0 && (static_cast<std::size_t>(1) << (k - 1)) > size() && amount_ == prev) {
+      // correspoding text does not exists. (theoretical judgment via Pumping lemma)
+      throw Exception("invalid value: correspoinding text does not exists.");
+    }
+    prev = amount_;
+    k++;
+  }
+
+  MPVector row(size()+1), next;
+  row[DFA::START] = 1;
+  std::size_t length = 0;
+  while (k-- > 0) {
+    next = row;
+    next *= _extended_powers.square(k, tmpM);
+    if (next[_extended_state] + _match_epsilon <= value) {
+      row = next;
+      length += static_cast<std::size_t>(1) << k;
+    }
+  }
+
+  return length + 1;
 }
 
-// calculate maximum eigenvalue (frovenius root) using simple power method.
-double MPMatrix::frobenius_root() const
+// Return the number of all acceptable strings.
+// if it's infinite, then return -1;
+template <class Alphabet>
+Value BasicRANS<Alphabet>::amount() const
 {
-  MPVector start_vector(size()), prev_vector(size());
-  // (255/256)^10000 = 1.0049656577513434e-17, good precision
-  const std::size_t iteration = 10000;
+  // texts longer than 2 * size() exist iff there are infinitely many.
+  MPMatrix tmpM;
+  std::size_t k = 1;
+  while ((static_cast<std::size_t>(1) << k) < 2 * size()) k++;
 
-  for (std::size_t i = 0; i < size(); i++) {
-    start_vector[i] = 1;
+  Value amount_ = _extended_powers.square(k - 1, tmpM)(DFA::START, _extended_state);
+
+  if (amount_ != _extended_powers.square(k, tmpM)(DFA::START, _extended_state)) {
+    return -1; // there exists infinite acceptable strings.
+  } else {
+    return amount_ + _match_epsilon;
   }
-  for (std::size_t i = 0; i < iteration; i++) {
-    start_vector *= *this;
+}
+
+// Return the number of all acceptable strings of
+// (less than, if amount is true) 'length' characters in length.
+template <class Alphabet>
+Value BasicRANS<Alphabet>::count(std::size_t length, bool amount) const
+{
+  // short lengths are rows of the suffix table, at a sparse product each,
+  // longer ones terms of the linear recurrences.
+  if (length <= size() && _suffixes.row(length) != NULL) {
+    Value count_ = (*_suffixes.row(length))[DFA::START];
+    for (std::size_t l = 0; amount && l < length; l++) count_ += (*_suffixes.row(l))[DFA::START];
+    return count_;
   }
-  for (std::size_t i = 0; i < size(); i++) {
-    prev_vector[i] = start_vector[i];
+
+  Value count_;
+  if (amount) {
+    _amounts.term(length, count_);
+    return count_ + _match_epsilon;
+  } else {
+    return _counts.term(length, count_);
+  }
+}
+
+template <class Alphabet>
+const RANS BasicRANS<Alphabet>::baseBYTE(".*");
+
+template <class Alphabet>
+std::string& BasicRANS<Alphabet>::compress(const std::string& text, std::string& dst) const
+{
+  Value value;
+  return baseBYTE(val(text, value), dst);
+}
+
+template <class Alphabet>
+std::string& BasicRANS<Alphabet>::decompress(const std::string& text, std::string& dst) const
+{
+  Value value;
+  return rep(baseBYTE(text, value), dst);
+}
+
+template <class Alphabet>
+class BasicRANS<Alphabet>::Roots: public ThreadPool::Task {
+ public:
+  Roots(const BasicRANS& rans, std::vector<double>& roots): _rans(rans), _roots(roots) {}
+  void operator()(std::size_t begin, std::size_t end)
+  {
+    MPMatrix tmpM;
+    for (std::size_t i = begin; i < end; i++) {
+      _rans._adjacency_matrix.sub_matrix(_rans._scc[i], tmpM);
+      _roots[i] = tmpM.frobenius_root();
+    }
+  }
+ private:
+  const BasicRANS& _rans;
+  std::vector<double>& _roots;
+};
+
+template <class Alphabet>
+const typename BasicRANS<Alphabet>::Spectrum& BasicRANS<Alphabet>::spectrum() const
+{
+  if (_spectrum.multiplicity != 0 || _scc.empty()) return _spectrum;
+
+  // the components are independent, so their roots are found in parallel.
+  std::vector<double> roots(_scc.size());
+  Roots task(*this, roots);
+  ThreadPool::shared().parallel_for(_scc.size(), task, 1);
+
+  for (std::size_t i = 0; i < _scc.size(); i++) {
+    double frobenius_root = roots[i];
+    if (fabs(_spectrum.root - frobenius_root) < 0.001) {
+      _spectrum.multiplicity++;
+    } else if (frobenius_root > _spectrum.root) {
+      _spectrum.root = frobenius_root;
+      _spectrum.multiplicity = 1;
+    }
+  }
+
+  assert(_spectrum.root != 0 && _spectrum.multiplicity != 0);
+  return _spectrum;
+}
+
+template <class Alphabet>
+double BasicRANS<Alphabet>::compression_ratio(int count_, const RANS& base) const
+{
+  if (count_ < 0) {
+    // return asymptotic ratio based on frobenius root.
+    if (spectrum().root == 0 || base.spectrum().root == 0) { // finite language
+      throw "compression ratio is only defined on infinite langauges.";
+    }
+
+    if (base.spectrum().root != 1) {
+      return log(spectrum().root) / log(base.spectrum().root);
+    } else if (spectrum().root != 1) {
+      // compression ratio is infinity, then return -1;
+      return -1;
+    }
   }
-  start_vector *= *this;
-  
-  Value value, prev_value;
-  MPVector::inner_prod(start_vector, start_vector, value);
-  MPVector::inner_prod(start_vector, prev_vector, prev_value);
 
-  mpf_class root = value;
-  root /= prev_value;
-  
-  return root.get_d();
+  return static_cast<double>(base.rep(count(count_, true) - 1).length()) / count_;
+}
+
+template <class Alphabet>
+double BasicRANS<Alphabet>::compression_ratio(const std::string& text, const RANS& base) const
+{
+  return static_cast<double>(base.length_of(val(text))) / text.length();
 }
 
-class RANS {
+// rans::BasicUnionRANS ranks the union of pairwise disjoint languages
+// without building the DFA of the union, which may be far larger than the
+// DFAs of the branches (e.g. a huge top-level alternation). the value of a
+// text is the sum over the branches of the texts below it (see
+// BasicRANS::below()), and rep() picks each symbol by the same partial sums.
+// disjointness is checked on the byte DFAs of the branches, walked together.
+template <class Alphabet>
+class BasicUnionRANS {
  public:
-  class Exception: public std::out_of_range {
-   public:
-    Exception(const std::string& error): std::out_of_range(error) {}
-  };
-  struct Spectrum {
-    Spectrum(double r, std::size_t m): root(m), multiplicity(m) {}
-    double root;
-    std::size_t multiplicity;
-  };
-  enum Encoding { ASCII = 0, UTF8 = 1 };
-  typedef rans::Value Value;
-  RANS(const std::string&, Encoding, bool, bool, bool);
+  typedef BasicRANS<Alphabet> Branch;
+  typedef typename Branch::Encoding Encoding;
+  typedef typename Branch::Edge Edge;
+  typedef rans::Exception Exception;
+  BasicUnionRANS(const std::vector<std::string>&, Encoding = Branch::ASCII, bool = false,
+                 const Limits& = Limits());
+  ~BasicUnionRANS();
   bool ok() const { return _ok; }
   const std::string& error() const { return _error; }
-  bool accept(const std::string& text) const { return _dfa.accept(text); }
+  std::size_t size() const { return _branches.size(); }
+  const Branch& operator[](std::size_t i) const { return *_branches[i]; }
+  int branch(const std::string&) const;
+  bool accept(const std::string& text) const { return branch(text) != -1; }
   Value& val(const std::string&, Value&) const;
   Value val(const std::string& text) const { Value value; return val(text, value); }
   std::string& rep(const Value&, std::string &) const;
   std::string rep(const Value& value) const { std::string text; return rep(value, text); }
-  const DFA& dfa() const { return _dfa; }
-  const MPMatrix& adjacency_matrix() const { return _adjacency_matrix; }
-  const MPMatrix& extended_adjacency_matrix() const { return _extended_adjacency_matrix; }
-  const std::vector<std::set<std::size_t> >& scc() const { return _scc; }
-  std::size_t size() const { return _dfa.size(); }
   Value amount() const;
-  bool finite() const { return amount() != -1; }
-  bool infinite() const { return !finite(); }
-  Value amount(std::size_t length) const { return count(length, true); }
-  Value count(std::size_t length) const { return count(length, false); }
-  const Spectrum& spectrum() const;
-  // useful aliases for val & rep
+  Value amount(std::size_t length) const;
+  Value count(std::size_t length) const;
   Value& operator()(const std::string& text, Value& value) const { return val(text, value); }
   Value operator()(const std::string& text) const { return val(text); }
   std::string& operator()(const Value& value, std::string& text) const { return rep(value, text); }
   std::string operator()(const Value& value) const { return rep(value); }
-  std::string compress(const std::string& text) const { std::string dst; return compress(text, dst); }
-  std::string decompress(const std::string& text) const { std::string dst; return decompress(text, dst); }
-  std::string& compress(const std::string&, std::string&) const;
-  std::string& decompress(const std::string&, std::string&) const;
-  double compression_ratio(int count, const RANS&) const;
-  double compression_ratio(const std::string& text, const RANS&) const;
-  static const RANS baseBYTE;
-
  private:
   //DISALLOW COPY AND ASSIGN
-  RANS(const RANS&);
-  void operator=(const RANS&);
+  BasicUnionRANS(const BasicUnionRANS&);
+  void operator=(const BasicUnionRANS&);
   std::size_t length_of(const Value&) const;
-  Value count(std::size_t length, bool amount) const;
   // fields
   bool _ok;
   std::string _error;
-  DFA _dfa;
-  std::vector<std::set<std::size_t> > _scc;
-  mutable Spectrum _spectrum;
-  const int _match_epsilon;
-  MPMatrix _adjacency_matrix;
-  MPMatrix _extended_adjacency_matrix;
-  const int _extended_state;
-  MPVector _start_vector;
-  MPVector _accept_vector;
+  std::vector<Branch*> _branches;
 };
 
-RANS::RANS(const std::string &regex, Encoding enc = ASCII, bool factorial = false, bool ignorecase = false, bool minimizing = true):
-    _ok(true), _dfa(regex, rans::Encoding(enc), minimizing, factorial, ignorecase),
-    _spectrum(0, 0),
-    _match_epsilon(_dfa.accept(DFA::START) ? 1 : 0),
-    _extended_state(_dfa.size())
+template <class Alphabet>
+BasicUnionRANS<Alphabet>::BasicUnionRANS(const std::vector<std::string>& regexes, Encoding enc,
+                                         bool ignorecase, const Limits& limits): _ok(true)
 {
-  if (!_dfa.ok()) {
-    _ok = false;
-    _error = _dfa.error();
-    return;
+  std::vector<typename Branch::Spec> specs;
+  for (std::size_t i = 0; i < regexes.size(); i++) {
+    specs.push_back(typename Branch::Spec(regexes[i], enc, false, ignorecase, true, limits));
   }
+  typename Branch::Batch batch;
+  Branch::compile(specs, batch);
 
-  _adjacency_matrix.resize(size(), size());
-  _extended_adjacency_matrix.resize(size()+1, size()+1);
-  _start_vector.resize(size());
-  _start_vector[DFA::START] = 1;
-  _accept_vector.resize(size());
+  for (std::size_t i = 0; _ok && i < batch.size(); i++) {
+    if (!batch.ok(i)) {
+      _ok = false;
+      _error = batch.error(i);
+    }
+  }
 
-  for (std::size_t i = 0; i < size(); i++) {
-    if (_dfa.accept(i)) _accept_vector[i] = 1;
+  // the branches are walked together over the tuples of their states
+  // (the live ones), from the tuple of their START states, until two of
+  // them accept at once. a tuple with less than two live branches can't
+  // lead there, so it is not followed. the batch keeps the branches until
+  // they are checked, so nothing leaks if a check throws.
+  typedef std::vector<std::pair<std::size_t, int> > Tuple; // (branch, state)
+  std::set<Tuple> tuples;
+  std::vector<const Tuple*> queue;
+  Budget budget(limits);
+  if (_ok && batch.size() > 1) {
+    Tuple start;
+    for (std::size_t i = 0; i < batch.size(); i++) start.push_back(std::make_pair(i, int(DFA::START)));
+    queue.push_back(&*tuples.insert(start).first);
+  }
 
-    for (std::size_t c = 0; c < 256; c++) {
-      if (_dfa[i][c] != DFA::REJECT) {
-        _adjacency_matrix(i, _dfa[i][c])++;
-        _extended_adjacency_matrix(i, _dfa[i][c])++;
-        if (_dfa.accept(_dfa[i][c])) {
-          _extended_adjacency_matrix(i, _extended_state)++;
+  try {
+    std::size_t bytes = 0;
+    for (std::size_t k = 0; _ok && k < queue.size(); k++) {
+      const Tuple& tuple = *queue[k];
+      std::size_t accepting = tuple.size();
+      for (std::size_t i = 0; _ok && i < tuple.size(); i++) {
+        if (!batch[tuple[i].first].dfa().accept(tuple[i].second)) continue;
+        if (accepting == tuple.size()) {
+          accepting = i;
+          continue;
         }
+        std::stringstream error;
+        error << "union construct error: branches " << tuple[accepting].first
+              << " and " << tuple[i].first << " are not disjoint";
+        _ok = false;
+        _error = error.str();
+      }
+      bytes += tuple.size() * sizeof(tuple[0]) + sizeof(Tuple) + 64;
+      budget.check(queue.size(), bytes);
+
+      for (std::size_t c = 0; _ok && c < 256; c++) {
+        Tuple next;
+        for (std::size_t i = 0; i < tuple.size(); i++) {
+          int state = batch[tuple[i].first].dfa()[tuple[i].second][c];
+          if (state != DFA::REJECT) next.push_back(std::make_pair(tuple[i].first, state));
+        }
+        if (next.size() < 2) continue;
+        std::pair<typename std::set<Tuple>::iterator, bool> inserted = tuples.insert(next);
+        if (inserted.second) queue.push_back(&*inserted.first);
       }
     }
+  } catch (const char* error) {
+    _ok = false;
+    _error = "union construct error: ";
+    _error += error;
   }
+  if (!_ok) return;
 
-  _adjacency_matrix.scc(_scc);
-  _extended_adjacency_matrix(_extended_state, _extended_state) = 1;
+  _branches.reserve(batch.size());
+  for (std::size_t i = 0; i < batch.size(); i++) _branches.push_back(batch.release(i));
 }
 
-// val(), which caliculates the value corresponds given text, is fundamental function of ANS.
-// val() is bijection: L -> N where L is set of acceptable string defined by
-// regular expression (DFA), and N is natural number (include 0).
-// (inverse function of this is rep())
-//
-// This implementation runs in time O(n * |D|^2) where n is the length of the text
-// and |D| is the size of(number of states of) the DFA.
-//
-// val() throws exception when text is not acceptable.
-// Therefore caller should assure that text is acceptable when calling this function.
-// caller could check like as: "if(accept(text)) val(text, value);".
-RANS::Value& RANS::val(const std::string& text, Value& value) const
+template <class Alphabet>
+BasicUnionRANS<Alphabet>::~BasicUnionRANS()
 {
-  int state = DFA::START;
-  value = 0;
-  MPVector paths(size());
+  for (std::size_t i = 0; i < size(); i++) delete _branches[i];
+}
 
-  for (std::size_t i = 0; state != DFA::REJECT && i < text.length(); i++) {
-    paths[DFA::START]++;
-    for (std::size_t c = 0; c < static_cast<unsigned char>(text[i]); c++) {
-      int next = _dfa[state][c];
-      if (next != DFA::REJECT) paths[next]++;
-    }
-    state = _dfa[state][static_cast<unsigned char>(text[i])];
-    if (i < text.length() - 1) paths *= _adjacency_matrix;
+// the (only) branch which accepts the text, or -1.
+template <class Alphabet>
+int BasicUnionRANS<Alphabet>::branch(const std::string& text) const
+{
+  for (std::size_t i = 0; i < size(); i++) {
+    if (_branches[i]->accept(text)) return i;
   }
+  return -1;
+}
 
-  if (!_dfa.accept(state)) throw Exception("invalid text: text is not acceptable.");
+template <class Alphabet>
+Value& BasicUnionRANS<Alphabet>::val(const std::string& text, Value& value) const
+{
+  if (!accept(text)) throw Exception("invalid text: text is not acceptable.");
+
+  Value below;
+  value = 0;
+  for (std::size_t i = 0; i < size(); i++) value += _branches[i]->below(text, below);
 
-  MPVector::inner_prod(paths, _accept_vector, value);
-  
   return value;
 }
 
-// rep(), which caliculates the text corresponds given value, is fundamental function of ANS.
-// rep() is bijection: N -> L where and N is natural number (include 0) and L is
-// set of acceptable string defined by regular expression (DFA).
-// (inverse function of this is val())
-//
-// This implementation runs in time roughly O(n log n |D|^3) where n is the length
-// of text and |D| is the size of(number of states of) DFA.
-//
-// This will Throw exception when there exists no text s.t. val(text) == value.
-// Therefore caller should assure that there exists a correspoding text when
-// calling this function. but don't worry, this condition is always true if caller
-// got the value via val() just like: "value = val(text)"
-std::string& RANS::rep(const Value& value, std::string& text) const
+// rep() walks the branches in lockstep: each symbol is chosen by the sum of
+// the acceptable suffixes of the branches' states, over the ranges of
+// symbols on which no branch changes its next state.
+template <class Alphabet>
+std::string& BasicUnionRANS<Alphabet>::rep(const Value& value, std::string& text) const
 {
   if (value < 0) throw Exception("invalid value: correspoinding text does not exists.");
-  
-  MPMatrix tmpM(size(), size());
-  int state = DFA::START;
-  Value value_ = value, val, val_;
+
+  Value value_ = value, val, block, offset;
   std::size_t length = length_of(value_);
-  if (length > 0) value_ -= count(length - 1, true);
+  if (length > 0) value_ -= amount(length - 1);
+  std::vector<int> states(size(), DFA::START);
+  std::vector<MPMatrix> tmpM(size());
+  std::vector<const MPVector*> suffixes(size());
+  std::vector<unsigned int> bounds;
+  std::vector<int> next(size());
   text = "";
 
   while (length-- != 0) {
-    val = val_ = 0;
-    power(_adjacency_matrix, length, tmpM);
+    bounds.clear();
+    for (std::size_t i = 0; i < size(); i++) {
+      if (states[i] == DFA::REJECT) continue;
+      const Branch& b = *_branches[i];
+      suffixes[i] = b._suffixes.row(length);
+      if (suffixes[i] == NULL) {
+        tmpM[i].resize(b.size(), b.size());
+        b._powers.power(length, tmpM[i]);
+      }
+      const std::vector<Edge>& edges = b._edges[states[i]];
+      for (std::size_t j = 0; j < edges.size(); j++) {
+        bounds.push_back(edges[j].first);
+        bounds.push_back(edges[j].last + 1);
+      }
+    }
+    std::sort(bounds.begin(), bounds.end());
+    bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
 
-    for (std::size_t c = 0; c < 256; c++) {
-      int next = _dfa[state][c];
-      if (next == DFA::REJECT) continue;
-      
-      val_ = val;
+    std::size_t k;
+    for (k = 0; k + 1 < bounds.size(); k++) {
+      // [bounds[k], bounds[k+1]) leads every branch to one state.
+      val = 0;
       for (std::size_t i = 0; i < size(); i++) {
-        if (_dfa.accept(i)) val += tmpM(next, i);
+        next[i] = DFA::REJECT;
+        if (states[i] == DFA::REJECT) continue;
+        const Branch& b = *_branches[i];
+        const std::vector<Edge>& edges = b._edges[states[i]];
+        for (std::size_t j = 0; j < edges.size() && edges[j].first <= bounds[k]; j++) {
+          if (bounds[k] <= edges[j].last) next[i] = edges[j].next;
+        }
+        if (next[i] == DFA::REJECT) continue;
+        if (suffixes[i] != NULL) {
+          val += (*suffixes[i])[next[i]];
+          continue;
+        }
+        for (std::size_t s = 0; s < b.size(); s++) {
+          if (b._accept_vector[s] != 0) val += tmpM[i](next[i], s);
+        }
       }
-      
-      if (val > value_) {
-        text.append(1, c);
-        state = next;
-        value_ -= val_;
+      block = val * (bounds[k+1] - bounds[k]);
+
+      if (value_ < block) {
+        offset = value_ / val;
+        _branches.front()->encode(bounds[k] + offset.get_ui(), text);
+        states = next;
+        value_ -= offset * val;
         break;
       }
+      value_ -= block;
     }
+    if (k + 1 >= bounds.size()) throw Exception("invalid value: correspoinding text does not exists.");
   }
 
   return text;
 }
 
-std::size_t RANS::length_of(const Value& value) const
+// the length of rep(value): the shortest length whose amount exceeds it,
+// by exponential then binary search.
+template <class Alphabet>
+std::size_t BasicUnionRANS<Alphabet>::length_of(const Value& value) const
 {
-  if (value < _match_epsilon) return 0;
+  Value total = amount();
+  if (total != -1 && value >= total) {
+    throw Exception("invalid value: correspoinding text does not exists.");
+  }
+
+  std::size_t lo = 0, hi = 1;
+  if (amount(0) > value) return 0;
+  while (amount(hi) <= value) {
+    lo = hi;
+    hi *= 2;
+  }
+  while (hi - lo > 1) { // amount(lo) <= value < amount(hi)
+    std::size_t mid = lo + (hi - lo) / 2;
+    if (amount(mid) <= value) lo = mid;
+    else hi = mid;
+  }
 
-  MPMatrix tmpM(size()+1, size()+1), tmpM_(size()+1, size()+1);
-  tmpM = _extended_adjacency_matrix;
+  return hi;
+}
 
-  if (tmpM(DFA::START, _extended_state) + _match_epsilon > value) {
-    return 1;
+// the number of all acceptable strings, -1 if it's infinite.
+template <class Alphabet>
+Value BasicUnionRANS<Alphabet>::amount() const
+{
+  Value amount_ = 0;
+  for (std::size_t i = 0; i < size(); i++) {
+    Value a = _branches[i]->amount();
+    if (a == -1) return -1;
+    amount_ += a;
   }
-  
-  std::size_t length = 1;
-  // exponential search
-  do {
-    tmpM_ = tmpM;
-    tmpM *= tmpM;
-    if (length > size() &&
-        tmpM(DFA::START, _extended_state) == tmpM_(DFA::START, _extended_state)) {
-      // correspoding text does not exists. (theoretical judgment via Pumping lemma)
-      throw Exception("invalid value: correspoinding text does not exists.");
-    }
-    length *= 2;
-  } while (tmpM(DFA::START, _extended_state) + _match_epsilon <= value);
+  return amount_;
+}
 
-  // linear search
-  tmpM = tmpM_; length /= 2;
-  do {
-    tmpM_ = tmpM;
-    tmpM *= _extended_adjacency_matrix;
-    length++;
-  } while (tmpM(DFA::START, _extended_state) + _match_epsilon <= value);
+// the number of acceptable strings of at most (exactly, for count())
+// 'length' characters in length.
+template <class Alphabet>
+Value BasicUnionRANS<Alphabet>::amount(std::size_t length) const
+{
+  Value amount_ = 0;
+  for (std::size_t i = 0; i < size(); i++) amount_ += _branches[i]->amount(length);
+  return amount_;
+}
 
-  return length;
+template <class Alphabet>
+Value BasicUnionRANS<Alphabet>::count(std::size_t length) const
+{
+  Value count_ = 0;
+  for (std::size_t i = 0; i < size(); i++) count_ += _branches[i]->count(length);
+  return count_;
 }
 
-// Return the number of all acceptable strings.
-// if it's infinite, then return -1;
-Value RANS::amount() const
+// rans::Classifier tells which of N languages accept a text in one scan, to
+// route it to the right RANS. it walks the product of their DFAs, whose
+// states (tuples of component states) and transitions are built lazily as
+// texts visit them, so only the reachable part of the product is ever built.
+// the cache is flushed when it grows over max_states. threads may classify
+// texts through one classifier: walks over cached transitions share a read
+// lock, and a walk that misses one goes on under the write lock.
+// NOTE: acceptance is the one of the byte DFAs (see RANS::dfa()), so
+// add() takes ASCII and UTF8 languages only.
+class Classifier {
+ public:
+  Classifier(std::size_t max_states = 1 << 16): _max_states(max_states) { pthread_rwlock_init(&_lock, NULL); }
+  ~Classifier() { pthread_rwlock_destroy(&_lock); }
+  std::size_t add(const RANS&);
+  std::size_t size() const { return _languages.size(); }
+  const RANS& operator[](std::size_t i) const { return *_languages[i]; }
+  std::vector<std::size_t>& classify(const std::string&, std::vector<std::size_t>&) const;
+  std::vector<std::size_t> classify(const std::string& text) const { std::vector<std::size_t> tags; return classify(text, tags); }
+  const RANS* route(const std::string&) const;
+  std::size_t states() const;
+ private:
+  //DISALLOW COPY AND ASSIGN
+  Classifier(const Classifier&);
+  void operator=(const Classifier&);
+  enum State_t { UNKNOWN = -2 };
+  struct State {
+    std::vector<int> tuple;
+    std::vector<std::size_t> accepts;
+    int next[256];
+  };
+  int state(const std::vector<int>&) const;
+  int next(int, unsigned char) const;
+  void flush() const { _states.clear(); _index.clear(); }
+  // fields
+  std::size_t _max_states;
+  std::vector<const RANS*> _languages;
+  mutable std::deque<State> _states;
+  mutable std::map<std::vector<int>, int> _index;
+  mutable pthread_rwlock_t _lock; // of the cache
+};
+
+// the given RANS must outlive the classifier. returns its tag.
+std::size_t Classifier::add(const RANS& rans)
 {
-  MPMatrix tmpM(size()+1, size()+1);
-  tmpM = _extended_adjacency_matrix;
+  // the byte DFA of a CODEPOINT language also has paths of invalid UTF-8.
+  if (rans.encoding() == RANS::CODEPOINT) throw RANS::Exception("classifier: codepoint languages are not supported.");
+
+  pthread_rwlock_wrlock(&_lock);
+  flush();
+  _languages.push_back(&rans);
+  std::size_t tag = _languages.size() - 1;
+  pthread_rwlock_unlock(&_lock);
+  return tag;
+}
+
+// the number of cached product states.
+std::size_t Classifier::states() const
+{
+  pthread_rwlock_rdlock(&_lock);
+  std::size_t states_ = _states.size();
+  pthread_rwlock_unlock(&_lock);
+  return states_;
+}
 
-  std::size_t length = 1;
-  Value amount_ = _match_epsilon;
+// the id of the product state for the tuple, or REJECT if every component
+// is dead.
+int Classifier::state(const std::vector<int>& tuple) const
+{
+  std::map<std::vector<int>, int>::iterator iter = _index.find(tuple);
+  if (iter != _index.end()) return iter->second;
 
-  do {
-    amount_ = tmpM(DFA::START, _extended_state);
-    tmpM *= tmpM;
-    length *= 2;
-  } while (length < 2 * size());
+  bool dead = true;
+  for (std::size_t i = 0; i < tuple.size(); i++) dead &= tuple[i] == DFA::REJECT;
+  if (dead) return DFA::REJECT;
 
-  if (amount_ != tmpM(DFA::START, _extended_state)) {
-    return -1; // there exists infinite acceptable strings.
-  } else {
-    return amount_ + _match_epsilon;
+  _states.resize(_states.size() + 1);
+  State& state = _states.back();
+  state.tuple = tuple;
+  std::fill(state.next, state.next+256, static_cast<int>(UNKNOWN));
+  for (std::size_t i = 0; i < tuple.size(); i++) {
+    if (_languages[i]->dfa().accept(tuple[i])) state.accepts.push_back(i);
   }
+
+  return _index[tuple] = _states.size() - 1;
 }
 
-// Return the number of all acceptable strings of
-// (less than, if amount is true) 'length' characters in length.
-Value RANS::count(std::size_t length, bool amount) const
+int Classifier::next(int id, unsigned char c) const
 {
-  const std::size_t size_ = amount ? size()+1 : size();
-  MPMatrix tmpM(size_, size_);
+  if (_states[id].next[c] != UNKNOWN) return _states[id].next[c];
 
-  power(amount ? _extended_adjacency_matrix : _adjacency_matrix, length, tmpM);
+  std::vector<int> tuple(_states[id].tuple);
+  std::vector<int> next_tuple(tuple.size());
+  for (std::size_t i = 0; i < tuple.size(); i++) {
+    next_tuple[i] = tuple[i] == DFA::REJECT ? DFA::REJECT : _languages[i]->dfa()[tuple[i]][c];
+  }
 
-  if (amount) {
-    return tmpM(DFA::START, _extended_state) + _match_epsilon;
-  } else {
-    Value count_;
-    for (std::size_t i = 0; i < size(); i++) {
-      if (_dfa.accept(i)) count_ += tmpM(DFA::START, i);
-    }
-    return count_;
+  if (_states.size() >= _max_states) {
+    flush();
+    id = state(tuple);
   }
+  int next = state(next_tuple);
+  _states[id].next[c] = next;
+
+  return next;
 }
 
-const RANS RANS::baseBYTE(".*");
+// the tags of the languages which accept the text, in ascending order.
+std::vector<std::size_t>& Classifier::classify(const std::string& text, std::vector<std::size_t>& tags) const
+{
+  tags.clear();
+  pthread_rwlock_rdlock(&_lock);
+  if (_languages.empty()) {
+    pthread_rwlock_unlock(&_lock);
+    return tags;
+  }
+
+  std::vector<int> tuple(_languages.size());
+  for (std::size_t i = 0; i < _languages.size(); i++) {
+    tuple[i] = _languages[i]->ok() ? static_cast<int>(DFA::START) : DFA::REJECT;
+  }
+
+  // as far as the transitions are cached, under the read lock.
+  std::size_t i = 0;
+  std::map<std::vector<int>, int>::const_iterator iter = _index.find(tuple);
+  int id = iter == _index.end() ? static_cast<int>(UNKNOWN) : iter->second;
+  for (; id >= 0 && i < text.length(); i++) {
+    const int next_ = _states[id].next[static_cast<unsigned char>(text[i])];
+    if (next_ == UNKNOWN) break;
+    id = next_;
+  }
+
+  if (id >= 0 && i < text.length()) tuple = _states[id].tuple;
+  if (id != UNKNOWN && (id == DFA::REJECT || i == text.length())) {
+    if (id != DFA::REJECT) tags = _states[id].accepts;
+    pthread_rwlock_unlock(&_lock);
+    return tags;
+  }
+  pthread_rwlock_unlock(&_lock);
+
+  // the rest under the write lock. the cache may have been flushed in
+  // between, so the walk resumes from the tuple of its state.
+  pthread_rwlock_wrlock(&_lock);
+  id = state(tuple);
+  for (; id != DFA::REJECT && i < text.length(); i++) {
+    id = next(id, text[i]);
+  }
+  if (id != DFA::REJECT) tags = _states[id].accepts;
+  pthread_rwlock_unlock(&_lock);
+  return tags;
+}
 
-std::string& RANS::compress(const std::string& text, std::string& dst) const
+// the first language (in order of add()) which accepts the text, or NULL.
+const RANS* Classifier::route(const std::string& text) const
 {
-  Value value;
-  return baseBYTE(val(text, value), dst);
+  std::vector<std::size_t> tags;
+  classify(text, tags);
+  return tags.empty() ? NULL : _languages[tags.front()];
 }
 
-std::string& RANS::decompress(const std::string& text, std::string& dst) const
+// rans::DynamicRANS is ANS on a finite language which changes over time:
+// words can be inserted and erased online. the language is kept as a minimal
+// DAWG, and each node holds the number of accepted suffixes per length.
+// an update only recomputes those counts along the changed word, instead of
+// rebuilding a DFA and its matrices as constructing a new RANS would.
+class DynamicRANS {
+ public:
+  typedef rans::Value Value;
+  typedef RANS::Exception Exception;
+  DynamicRANS(): _counts(1) {}
+  DynamicRANS(const std::vector<std::string>&);
+  bool insert(const std::string&);
+  bool erase(const std::string&);
+  bool accept(const std::string& text) const { return _dawg.accept(text); }
+  Value& val(const std::string&, Value&) const;
+  Value val(const std::string& text) const { Value value; return val(text, value); }
+  std::string& rep(const Value&, std::string &) const;
+  std::string rep(const Value& value) const { std::string text; return rep(value, text); }
+  Value& operator()(const std::string& text, Value& value) const { return val(text, value); }
+  Value operator()(const std::string& text) const { return val(text); }
+  std::string& operator()(const Value& value, std::string& text) const { return rep(value, text); }
+  std::string operator()(const Value& value) const { return rep(value); }
+  const DAWG& dawg() const { return _dawg; }
+  std::size_t size() const { return _dawg.size(); }
+  Value amount() const { return amount(_counts[DAWG::ROOT].size()); }
+  Value amount(std::size_t length) const;
+  Value count(std::size_t length) const { return count(DAWG::ROOT, length); }
+
+ private:
+  //DISALLOW COPY AND ASSIGN
+  DynamicRANS(const DynamicRANS&);
+  void operator=(const DynamicRANS&);
+  const Value& count(int node, std::size_t length) const;
+  void update(int);
+  void update(const std::string&);
+  // fields
+  DAWG _dawg;
+  std::vector<std::vector<Value> > _counts; // _counts[node][length]
+};
+
+DynamicRANS::DynamicRANS(const std::vector<std::string>& words): _dawg(words), _counts(_dawg.capacity())
 {
-  Value value;
-  return rep(baseBYTE(text, value), dst);
+  // count the nodes in post-order (children first).
+  std::vector<bool> visited(_dawg.capacity(), false);
+  std::vector<std::pair<int, std::size_t> > stack(1, std::make_pair(int(DAWG::ROOT), 0));
+  visited[DAWG::ROOT] = true;
+
+  while (!stack.empty()) {
+    int node = stack.back().first;
+    std::size_t& i = stack.back().second;
+    const DAWG::Edges& edges = _dawg.node(node).edges;
+
+    if (i < edges.size()) {
+      int next = edges[i++].second;
+      if (!visited[next]) {
+        visited[next] = true;
+        stack.push_back(std::make_pair(next, 0));
+      }
+    } else {
+      update(node);
+      stack.pop_back();
+    }
+  }
 }
 
-const RANS::Spectrum& RANS::spectrum() const
+void DynamicRANS::update(int node)
 {
-  if (_spectrum.multiplicity != 0 || _scc.empty()) return _spectrum;
+  const DAWG::Node& n = _dawg.node(node);
+  std::vector<Value>& counts = _counts[node];
+  std::size_t length = n.accept ? 1 : 0;
 
-  MPMatrix tmpM;
+  for (std::size_t i = 0; i < n.edges.size(); i++) {
+    length = std::max(length, _counts[n.edges[i].second].size() + 1);
+  }
+  counts.assign(length, 0);
+  if (n.accept) counts[0] = 1;
+  for (std::size_t i = 0; i < n.edges.size(); i++) {
+    const std::vector<Value>& next = _counts[n.edges[i].second];
+    for (std::size_t l = 0; l < next.size(); l++) counts[l+1] += next[l];
+  }
+}
 
-  for (std::size_t i = 0; i < _scc.size(); i++) {
-    _adjacency_matrix.sub_matrix(_scc[i], tmpM);
-    double frobenius_root = tmpM.frobenius_root();
-    if (fabs(_spectrum.root - frobenius_root) < 0.001) {
-      _spectrum.multiplicity++;
-    } else if (frobenius_root > _spectrum.root) {
-      _spectrum.root = frobenius_root;
-      _spectrum.multiplicity = 1;
-    }
+// only the nodes on the path of the changed word can have a new language,
+// everything off the path is shared and unchanged.
+void DynamicRANS::update(const std::string& word)
+{
+  std::vector<int> path(1, DAWG::ROOT);
+  for (std::size_t i = 0; i < word.length(); i++) {
+    int next = _dawg.next(path.back(), static_cast<unsigned char>(word[i]));
+    if (next == -1) break;
+    path.push_back(next);
   }
 
-  assert(_spectrum.root != 0 && _spectrum.multiplicity != 0);
-  return _spectrum;
+  if (_counts.size() < _dawg.capacity()) _counts.resize(_dawg.capacity());
+  while (!path.empty()) {
+    update(path.back());
+    path.pop_back();
+  }
 }
 
-double RANS::compression_ratio(int count_ = -1, const RANS& base = baseBYTE) const
+bool DynamicRANS::insert(const std::string& word)
 {
-  if (count_ < 0) {
-    // return asymptotic ratio based on frobenius root.
-    if (spectrum().root == 0 || base.spectrum().root == 0) { // finite language
-      throw "compression ratio is only defined on infinite langauges.";
-    }
+  if (!_dawg.insert(word)) return false;
+  update(word);
+  return true;
+}
 
-    if (base.spectrum().root != 1) {
-      return log(spectrum().root) / log(base.spectrum().root);
-    } else if (spectrum().root != 1) {
-      // compression ratio is infinity, then return -1;
-      return -1;
+bool DynamicRANS::erase(const std::string& word)
+{
+  if (!_dawg.erase(word)) return false;
+  update(word);
+  return true;
+}
+
+const DynamicRANS::Value& DynamicRANS::count(int node, std::size_t length) const
+{
+  static const Value zero = 0;
+  return length < _counts[node].size() ? _counts[node][length] : zero;
+}
+
+DynamicRANS::Value DynamicRANS::amount(std::size_t length) const
+{
+  Value amount_ = 0;
+  for (std::size_t l = 0; l <= length && l < _counts[DAWG::ROOT].size(); l++) {
+    amount_ += _counts[DAWG::ROOT][l];
+  }
+  return amount_;
+}
+
+// same numeration as RANS::val(): shortlex order over the current words.
+DynamicRANS::Value& DynamicRANS::val(const std::string& text, Value& value) const
+{
+  int node = DAWG::ROOT;
+  value = text.length() > 0 ? amount(text.length() - 1) : 0;
+
+  for (std::size_t i = 0; i < text.length(); i++) {
+    unsigned char c = static_cast<unsigned char>(text[i]);
+    const DAWG::Edges& edges = _dawg.node(node).edges;
+    std::size_t j = 0;
+    for (; j < edges.size() && edges[j].first < c; j++) {
+      value += count(edges[j].second, text.length() - i - 1);
     }
+    if (j == edges.size() || edges[j].first != c) {
+      throw Exception("invalid text: text is not acceptable.");
+    }
+    node = edges[j].second;
   }
 
-  return static_cast<double>(base.rep(count(count_, true) - 1).length()) / count_;
+  if (!_dawg.node(node).accept) throw Exception("invalid text: text is not acceptable.");
+
+  return value;
 }
 
-double RANS::compression_ratio(const std::string& text, const RANS& base = baseBYTE) const
+std::string& DynamicRANS::rep(const Value& value, std::string& text) const
 {
-  return static_cast<double>(base.length_of(val(text))) / text.length();
+  const std::vector<Value>& root = _counts[DAWG::ROOT];
+  Value value_ = value;
+  std::size_t length = 0;
+
+  if (value < 0) throw Exception("invalid value: correspoinding text does not exists.");
+  for (; length < root.size() && value_ >= root[length]; length++) value_ -= root[length];
+  if (length == root.size()) throw Exception("invalid value: correspoinding text does not exists.");
+
+  int node = DAWG::ROOT;
+  text = "";
+  while (length-- != 0) {
+    const DAWG::Edges& edges = _dawg.node(node).edges;
+    for (std::size_t j = 0; j < edges.size(); j++) {
+      const Value& count_ = count(edges[j].second, length);
+      if (value_ < count_) {
+        text.append(1, edges[j].first);
+        node = edges[j].second;
+        break;
+      }
+      value_ -= count_;
+    }
+  }
+
+  return text;
 }
 
 } // namespace rans
 
 using rans::RANS; // export
+using rans::BasicRANS;
+using rans::UnionRANS;
+using rans::BasicUnionRANS;
+using rans::Classifier;
 
 #ifdef RANS_DEBUG // wrappers for gdb
 void dump(rans::DFA &v) { std::cout << v << std::endl; }
@@ -0,0 +1,69 @@
+#include <rans.hpp>
+
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <sys/time.h>
+
+// compares blocked_multiply() with winograd_multiply() on random matrices
+// of various sizes and entry lengths, to find where multiply() should
+// switch (MPMatrix::kWinogradSize, MPMatrix::kWinogradLimbs).
+//   usage: bench [repeat]
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static void random_matrix(gmp_randclass& random, std::size_t size, std::size_t limbs, rans::MPMatrix& X)
+{
+  X.resize(size);
+  for (std::size_t i = 0; i < size; i++) {
+    for (std::size_t j = 0; j < size; j++) {
+      X(i, j) = random.get_z_bits(limbs * GMP_NUMB_BITS);
+    }
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  const std::size_t repeat = argc > 1 ? std::atoi(argv[1]) : 1;
+  const std::size_t sizes[] = {16, 32, 64, 128, 192};
+  const std::size_t limbs[] = {1, 4, 16, 32, 64};
+  gmp_randclass random(gmp_randinit_default);
+
+  std::cout << std::setw(6) << "size" << std::setw(7) << "limbs"
+            << std::setw(12) << "blocked" << std::setw(12) << "winograd"
+            << std::setw(8) << "ratio" << std::endl;
+  for (std::size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    for (std::size_t l = 0; l < sizeof(limbs) / sizeof(limbs[0]); l++) {
+      rans::MPMatrix A, B, C, D;
+      random_matrix(random, sizes[s], limbs[l], A);
+      random_matrix(random, sizes[s], limbs[l], B);
+
+      double start = now();
+      for (std::size_t r = 0; r < repeat; r++) rans::blocked_multiply(A, B, C);
+      const double blocked = (now() - start) / repeat;
+      start = now();
+      for (std::size_t r = 0; r < repeat; r++) rans::winograd_multiply(A, B, D);
+      const double winograd = (now() - start) / repeat;
+
+      for (std::size_t i = 0; i < sizes[s]; i++) {
+        for (std::size_t j = 0; j < sizes[s]; j++) {
+          if (C(i, j) != D(i, j)) {
+            std::cerr << "mismatch at size " << sizes[s] << ", limbs " << limbs[l] << std::endl;
+            return 1;
+          }
+        }
+      }
+      std::cout << std::setw(6) << sizes[s] << std::setw(7) << limbs[l]
+                << std::fixed << std::setprecision(5)
+                << std::setw(12) << blocked << std::setw(12) << winograd
+                << std::setprecision(2) << std::setw(8) << blocked / winograd << std::endl;
+    }
+  }
+
+  return 0;
+}
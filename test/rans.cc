@@ -19,6 +19,7 @@ DEFINE_string(value, "", "print the text of given value on ANS.");
 DEFINE_bool(verbose, false, "report additional informations.");
 DEFINE_bool(syntax, false, "print RANS regular expression syntax.");
 DEFINE_bool(utf8, false, "use utf8 as internal encoding.");
+DEFINE_bool(codepoint, false, "use utf8 as internal encoding, and rank texts by codepoints instead of bytes.");
 DEFINE_string(from, "", "convert the given value base from the given expression.");
 DEFINE_string(into, "", "convert the given value base to the given expression.");
 DEFINE_string(compress, "", "compress the given file (create '.rans' file, by default).");
@@ -32,6 +33,10 @@ DEFINE_bool(frobenius_root, false, "print frobenius root of adjacency matrix.");
 DEFINE_bool(frobenius_root2, false, "print frobenius root of adjacency matrix without linear algebraic optimization.");
 DEFINE_bool(factorial, false, "make langauge as a factorial");
 DEFINE_bool(tovalue, false, "convert the given text into the correspondence value");
+DEFINE_bool(estimate, false, "print an upper bound of the size of the DFA, without constructing it.");
+DEFINE_int64(max_states, 0, "fail if the DFA has more states (0: unlimited).");
+DEFINE_int64(max_bytes, 0, "fail if the construction needs more memory [bytes] (0: unlimited).");
+DEFINE_double(max_seconds, 0, "fail if the construction takes longer [sec] (0: unlimited).");
 
 void dispatch(const RANS&);
 void set_filename(const std::string&, std::string&);
@@ -70,7 +75,7 @@ int main(int argc, char* argv[])
     ifs >> FLAGS_text;
   }
 
-  RANS::Encoding enc = FLAGS_utf8 ? RANS::UTF8 : RANS::ASCII;
+  RANS::Encoding enc = FLAGS_codepoint ? RANS::CODEPOINT : FLAGS_utf8 ? RANS::UTF8 : RANS::ASCII;
   
   if (!FLAGS_from.empty() && !FLAGS_into.empty()) {
     RANS from(FLAGS_from, enc, FLAGS_factorial, FLAGS_i),
@@ -92,7 +97,14 @@ int main(int argc, char* argv[])
     return 0;
   }
 
-  RANS r(regex, enc, FLAGS_factorial, FLAGS_i, FLAGS_minimizing);
+  if (FLAGS_estimate) {
+    std::cout << rans::DFA::estimate(regex, enc == RANS::ASCII ? rans::ASCII : rans::UTF8,
+                                     FLAGS_factorial, FLAGS_i) << std::endl;
+    return 0;
+  }
+
+  rans::Limits limits(FLAGS_max_states, FLAGS_max_bytes, FLAGS_max_seconds);
+  RANS r(regex, enc, FLAGS_factorial, FLAGS_i, FLAGS_minimizing, limits);
   if (!r.ok()) {
     std::cerr << r.error() << std::endl;
     return 0;
@@ -1,7 +1,10 @@
 #include <gtest/gtest.h>
 #include <rans.hpp>
 #include <map>
+#include <set>
+#include <numeric>
 #include <fstream>
+#include <sstream>
 #include <string>
 
 TEST(ELEMENTAL_TEST, DFA_MINIMIZE) {
@@ -143,6 +146,64 @@ TEST(ELEMENTAL_TEST, DFA_ACCEPT) {
   }
 }
 
+TEST(ELEMENTAL_TEST, PARSER_HUGE_REGEX) {
+  // a generated dictionary (left-deep union of 100k alternatives) and
+  // a deeply nested group must neither overflow the stack nor go quadratic.
+  std::string dictionary;
+  for (std::size_t i = 0; i < 100000; i++) {
+    std::stringstream word;
+    word << (i == 0 ? "" : "|") << "w" << i;
+    dictionary += word.str();
+  }
+  rans::Parser p(dictionary, rans::ASCII);
+  ASSERT_TRUE(p.ok());
+
+  std::string nested = std::string(100000, '(') + "a" + std::string(100000, ')');
+  rans::DFA d(nested);
+  ASSERT_TRUE(d.ok());
+  ASSERT_TRUE(d.accept("a"));
+
+  rans::DFA dict(dictionary.substr(0, dictionary.find("|w20000")), rans::ASCII, false);
+  ASSERT_TRUE(dict.ok());
+  ASSERT_TRUE(dict.accept("w19999"));
+  ASSERT_TRUE(dict.accept("w0"));
+  ASSERT_FALSE(dict.accept("w20000"));
+
+  ASSERT_FALSE(rans::Parser(nested + ")", rans::ASCII).ok());
+  ASSERT_FALSE(rans::Parser("(" + nested, rans::ASCII).ok());
+}
+
+TEST(ELEMENTAL_TEST, UTF8_CHARCLASS) {
+  // hiragana: U+3041-U+3093
+  std::string hiragana = "(";
+  for (unsigned int c = 0x3041; c <= 0x3093; c++) {
+    unsigned char bytes[4];
+    std::size_t len = rans::utf8_encode(c, bytes);
+    hiragana += std::string(bytes, bytes + len) + (c < 0x3093 ? "|" : ")");
+  }
+  RANS r("[\xe3\x81\x81-\xe3\x82\x93]", RANS::UTF8), l(hiragana, RANS::UTF8);
+  ASSERT_TRUE(r.ok());
+  ASSERT_TRUE(r.dfa() == l.dfa());
+  ASSERT_EQ(83, r.amount());
+  ASSERT_TRUE(r.accept("\xe3\x81\x82"));
+  ASSERT_FALSE(r.accept("\xe3\x82\xa2"));
+  ASSERT_TRUE(RANS("[\\x{3041}-\\x{3093}]", RANS::UTF8).dfa() == r.dfa());
+  ASSERT_TRUE(RANS("\\x{3042}", RANS::UTF8).accept("\xe3\x81\x82"));
+
+  // every non-ASCII scalar value (without surrogates) in a handful of states.
+  RANS n("[^\\x{0}-\\x{7f}]", RANS::UTF8);
+  ASSERT_TRUE(n.ok());
+  ASSERT_EQ(9, n.size());
+  ASSERT_EQ(0x110000 - 0x80 - 0x800, n.amount());
+  ASSERT_TRUE(n.accept("\xf4\x8f\xbf\xbf"));
+  ASSERT_FALSE(n.accept("\xed\xa0\x80"));
+  ASSERT_FALSE(n.accept("a"));
+
+  RANS m("[a\xce\xb1-\xce\xb3z]+", RANS::UTF8);
+  ASSERT_TRUE(m.accept("a\xce\xb2z"));
+  ASSERT_FALSE(m.accept("\xce\xb4"));
+}
+
 TEST(COUNTING_TEST, RANS_COUNT_AND_AMOUNT) {
   struct testcase {
     testcase(std::string regex_, int amount_, int count_ = 0, std::size_t length_ = 0):
@@ -197,6 +258,70 @@ TEST(COUNTING_TEST, RANS_COUNT_AND_AMOUNT) {
   }
 }
 
+TEST(DICTIONARY_TEST, RANS_FROM_WORDS) {
+  const char* words_[] = {
+    "tap", "taps", "top", "tops", "", "stop", "stops", "star", "start", "tap"
+  };
+  std::vector<std::string> words(words_, words_ + sizeof(words_) / sizeof(char*));
+  RANS r(words), s("(tap|taps|top|tops|stop|stops|star|start)?");
+
+  ASSERT_TRUE(r.ok());
+  ASSERT_EQ(s.size(), r.size());
+  ASSERT_TRUE(r.dfa() == s.dfa());
+  ASSERT_EQ(9, r.amount());
+  ASSERT_EQ(s.count(4), r.count(4));
+  for (int i = 0; i < 9; i++) {
+    ASSERT_EQ(s.rep(i), r.rep(i));
+    ASSERT_EQ(i, r.val(r.rep(i)));
+  }
+
+  std::sort(words.begin(), words.end());
+  ASSERT_TRUE(rans::DFA(words) == s.dfa());
+  ASSERT_EQ(1, rans::DFA(std::vector<std::string>()).size());
+}
+
+TEST(DICTIONARY_TEST, DYNAMIC_RANS) {
+  // random insertions and deletions must keep the DAWG minimal and the
+  // numeration identical to a RANS rebuilt from scratch.
+  std::set<std::string> words;
+  rans::DynamicRANS d;
+  unsigned int seed = 12345;
+
+  for (std::size_t step = 0; step < 2000; step++) {
+    seed = seed * 1103515245 + 12345;
+    std::string word;
+    for (std::size_t len = (seed >> 16) % 6; len > 0; len--) {
+      seed = seed * 1103515245 + 12345;
+      word.append(1, "abc"[(seed >> 16) % 3]);
+    }
+    if (step % 3 == 2) {
+      ASSERT_EQ(words.erase(word) == 1, d.erase(word));
+    } else {
+      ASSERT_EQ(words.insert(word).second, d.insert(word));
+    }
+
+    if (step % 100 == 99) {
+      RANS r(std::vector<std::string>(words.begin(), words.end()));
+      ASSERT_EQ(r.size(), d.size());
+      ASSERT_EQ(r.amount(), d.amount());
+      ASSERT_EQ(r.count(3), d.count(3));
+      for (std::set<std::string>::iterator iter = words.begin(); iter != words.end(); ++iter) {
+        ASSERT_EQ(r.val(*iter), d.val(*iter));
+        ASSERT_EQ(*iter, d.rep(d.val(*iter)));
+      }
+    }
+  }
+  ASSERT_THROW(d.rep(d.amount()), RANS::Exception);
+
+  rans::DynamicRANS e(std::vector<std::string>(words.begin(), words.end()));
+  ASSERT_TRUE(e.erase(*words.begin()));
+  ASSERT_TRUE(d.erase(*words.begin()));
+  ASSERT_TRUE(e.insert("cabbage"));
+  ASSERT_TRUE(d.insert("cabbage"));
+  ASSERT_EQ(d.size(), e.size());
+  ASSERT_EQ(d.val("cabbage"), e.val("cabbage"));
+}
+
 // Theorem(Eilenberg): The set of squares { 1, 4, 9,.., n^2, .. }
 // is never recognizable in any integer base system.
 // 
@@ -276,7 +401,7 @@ TEST(URI_TEST, RANS_VAL) {
 
 TEST(URI_TEST, RANS_REP) {
   ASSERT_EQ(homepage_url, base_uri2396(homepage_val_rfc2396));
-  // ASSERT_EQ(homepage_url, base_uri3986(homepage_val_rfc3986));
+  ASSERT_EQ(homepage_url, base_uri3986(homepage_val_rfc3986));
 }
 
 TEST(URI_TEST, RANS_FINITE) {
@@ -290,3 +415,699 @@ TEST(URI_TEST, RANS_COMPRESSION_RATIO) {
   ASSERT_EQ(base_uri2396.spectrum().root, base_uri3986.spectrum().root);
   ASSERT_EQ(1.0, base_uri3986.compression_ratio(-1, base_uri2396)); // same compression ratio
 }
+
+TEST(URI_TEST, RANS_LONG_COUNT) {
+  // the counts of long lengths (from the recurrences) are the ones of the
+  // big-integer powers of the adjacency matrices.
+  const std::size_t length = 300;
+  rans::MPMatrix power;
+  rans::power(base_uri3986.adjacency_matrix(), length, power);
+  rans::Value count;
+  for (std::size_t i = 0; i < base_uri3986.size(); i++) {
+    if (base_uri3986.dfa().accept(i)) count += power(rans::DFA::START, i);
+  }
+  ASSERT_EQ(count, base_uri3986.count(length));
+  rans::power(base_uri3986.extended_adjacency_matrix(), length, power);
+  ASSERT_EQ(power(rans::DFA::START, base_uri3986.size()), base_uri3986.amount(length));
+  ASSERT_EQ(base_uri3986.amount(length - 1) + base_uri3986.count(length), base_uri3986.amount(length));
+}
+
+TEST(ELEMENTAL_TEST, CODEPOINT_RANKING) {
+  // U+3041 (small a) .. U+3093 (n): 83 symbols, ranked one codepoint at a time.
+  RANS r("[\xe3\x81\x81-\xe3\x82\x93]+", RANS::CODEPOINT);
+  ASSERT_TRUE(r.ok());
+  ASSERT_EQ(2, r.size());
+  ASSERT_EQ(83, r.count(1));
+  ASSERT_EQ(83 * 83, r.count(2));
+  ASSERT_EQ(r("\xe3\x81\x81") + 82, r("\xe3\x82\x93"));
+  ASSERT_EQ(r("\xe3\x82\x93") + 1, r("\xe3\x81\x81\xe3\x81\x81"));
+  for (int i = 0; i < 300; i++) {
+    std::string text;
+    ASSERT_EQ(i, r(r(i, text)));
+  }
+
+  RANS any("[\\x{0}-\\x{10ffff}]", RANS::CODEPOINT);
+  ASSERT_EQ(0x110000 - 0x800, any.count(1));
+  ASSERT_FALSE(any.accept("\xed\xa0\x80"));
+  ASSERT_THROW(any("\xc0\x80"), RANS::Exception);
+  std::string text;
+  ASSERT_EQ("\xf4\x8f\xbf\xbf", any(0x110000 - 0x800 - 1, text));
+
+  // ASCII texts rank the same way whichever alphabet is used.
+  RANS a("(ab|c)*d", RANS::ASCII), b("(ab|c)*d", RANS::CODEPOINT);
+  ASSERT_EQ(a.size(), b.size());
+  ASSERT_EQ(a("ababcd"), b("ababcd"));
+  ASSERT_EQ(a.amount(), b.amount());
+}
+
+TEST(ELEMENTAL_TEST, SMALL_ALPHABET) {
+  // ACGT are in byte order, so both rank [ACGT]+ the same way.
+  BasicRANS<rans::DNAAlphabet> dna("[ACGTN]+");
+  RANS bytes("[ACGT]+");
+  ASSERT_TRUE(dna.ok());
+  ASSERT_EQ(4, dna.count(1));
+  ASSERT_EQ(bytes("GATTACA"), dna("GATTACA"));
+  ASSERT_FALSE(dna.accept("GATTANA"));
+  ASSERT_THROW(dna("GATTANA"), RANS::Exception);
+  for (int i = 0; i < 200; i++) {
+    std::string text;
+    ASSERT_EQ(bytes(i), dna(i, text));
+  }
+
+  BasicRANS<rans::HexAlphabet> hex("0x[0-9a-fA-F]+");
+  ASSERT_EQ(0, hex.count(3));
+  BasicRANS<rans::HexAlphabet> digits("[0-9a-fA-F]+");
+  ASSERT_EQ(16, digits.count(1));
+  ASSERT_EQ("ff", digits(16 + 255));
+  ASSERT_TRUE(digits.accept("ff"));
+  ASSERT_FALSE(digits.accept("FF"));
+  ASSERT_THROW(digits.val("FF"), rans::Exception);
+  ASSERT_EQ(0, BasicRANS<rans::HexAlphabet>("[A-F]+").count(1));
+  typedef BasicRANS<rans::DNAAlphabet> DNARANS;
+  ASSERT_FALSE(DNARANS("A", DNARANS::CODEPOINT).ok());
+}
+
+TEST(ELEMENTAL_TEST, PRODUCT_OPERATORS) {
+  // words over [ab.] of at most 6 bytes without "..", checked by brute force.
+  RANS r("[ab.]*&.{0,6}-.*\\.\\..*");
+  ASSERT_TRUE(r.ok());
+  std::vector<std::string> texts(1, "");
+  int amount = 0;
+  for (std::size_t i = 0; i < texts.size(); i++) {
+    bool accept = texts[i].find("..") == std::string::npos;
+    ASSERT_EQ(accept, r.accept(texts[i])) << texts[i];
+    if (accept) amount++;
+    if (texts[i].length() < 6) {
+      texts.push_back(texts[i] + "."); texts.push_back(texts[i] + "a"); texts.push_back(texts[i] + "b");
+    }
+  }
+  ASSERT_EQ(amount, r.amount());
+
+  RANS c("~a*b");
+  ASSERT_TRUE(c.accept("bb"));
+  ASSERT_TRUE(c.accept("cab"));
+  ASSERT_FALSE(c.accept("aab"));
+
+  RANS p("x((ab|ba)-ba){2}y|cd&c.");
+  ASSERT_EQ(2, p.amount());
+  ASSERT_TRUE(p.accept("xababy"));
+  ASSERT_TRUE(p.accept("cd"));
+
+  ASSERT_TRUE(RANS("a\\-b\\&\\~").accept("a-b&~"));
+  ASSERT_EQ(0, RANS("a(b&c)d").amount());
+  ASSERT_FALSE(RANS("a&").ok());
+  ASSERT_FALSE(RANS("a~|b").ok());
+
+  // under ignorecase the operands are folded before their product.
+  ASSERT_FALSE(rans::DFA("~a", rans::ASCII, true, false, true).accept("a"));
+  ASSERT_FALSE(rans::DFA("~a", rans::ASCII, true, false, true).accept("A"));
+  ASSERT_TRUE(rans::DFA("~a", rans::ASCII, true, false, true).accept("b"));
+  RANS i("x-X", RANS::ASCII, false, true);
+  ASSERT_TRUE(i.ok());
+  ASSERT_EQ(0, i.amount());
+  RANS j("[a-z]+&ABC", RANS::ASCII, false, true);
+  ASSERT_TRUE(j.accept("abc"));
+  ASSERT_TRUE(j.accept("AbC"));
+  ASSERT_EQ(8, j.amount());
+
+  const char* missing[] = { "-", "~", "-a", "a|&b", "(~)", "a-" };
+  for (std::size_t k = 0; k < sizeof(missing) / sizeof(missing[0]); k++) {
+    RANS m(missing[k]);
+    ASSERT_FALSE(m.ok()) << missing[k];
+    ASSERT_NE(std::string::npos, m.error().find("missing operand")) << missing[k];
+  }
+}
+
+class ClassifyTask: public rans::ThreadPool::Task {
+ public:
+  ClassifyTask(const Classifier& classifier, const std::vector<std::string>& texts, std::vector<std::size_t>& tags):
+      _classifier(classifier), _texts(texts), _tags(tags) {}
+  void operator()(std::size_t begin, std::size_t end)
+  {
+    for (std::size_t i = begin; i < end; i++) _tags[i] = _classifier.classify(_texts[i]).size();
+  }
+ private:
+  const Classifier& _classifier;
+  const std::vector<std::string>& _texts;
+  std::vector<std::size_t>& _tags;
+};
+
+TEST(ELEMENTAL_TEST, CLASSIFIER) {
+  RANS number("[0-9]+"), hex("[0-9a-f]+"), word("[a-z]+");
+  for (std::size_t max_states = 1; max_states <= 1024; max_states *= 32) {
+    Classifier classifier(max_states);
+    ASSERT_EQ(0, classifier.add(number));
+    ASSERT_EQ(1, classifier.add(hex));
+    ASSERT_EQ(2, classifier.add(word));
+
+    std::vector<std::size_t> tags;
+    ASSERT_EQ(2, classifier.classify("123", tags).size());
+    ASSERT_EQ(0, tags[0]); ASSERT_EQ(1, tags[1]);
+    ASSERT_EQ(2, classifier.classify("cafe", tags).size());
+    ASSERT_EQ(1, tags[0]); ASSERT_EQ(2, tags[1]);
+    ASSERT_EQ(1, classifier.classify("coffee", tags).size());
+    ASSERT_EQ(2, tags[0]);
+    ASSERT_TRUE(classifier.classify("").empty());
+    ASSERT_TRUE(classifier.classify("12ab!").empty());
+
+    ASSERT_EQ(&hex, classifier.route("c0ffee"));
+    ASSERT_TRUE(classifier.route("?") == NULL);
+  }
+
+  // acceptance is the byte DFA's, which differs from a codepoint language.
+  Classifier bytes;
+  RANS kana("[\xe3\x81\x81-\xe3\x82\x93]+", RANS::CODEPOINT);
+  ASSERT_THROW(bytes.add(kana), rans::Exception);
+  ASSERT_EQ(0, bytes.size());
+
+  // threads share the cache (and its flushes) of one classifier.
+  const char* texts[] = { "123", "cafe", "coffee", "12ab!", "", "deadbeef", "42" };
+  const std::size_t n = sizeof(texts) / sizeof(texts[0]);
+  Classifier shared(4);
+  shared.add(number); shared.add(hex); shared.add(word);
+  std::vector<std::string> records(4096);
+  std::vector<std::size_t> expected(records.size()), routed(records.size());
+  for (std::size_t i = 0; i < records.size(); i++) {
+    records[i] = texts[i % n];
+    expected[i] = shared.classify(records[i]).size();
+  }
+  ClassifyTask task(shared, records, routed);
+  rans::ThreadPool::shared().resize(4);
+  rans::ThreadPool::shared().parallel_for(records.size(), task, 1);
+  rans::ThreadPool::shared().resize(0);
+  ASSERT_TRUE(expected == routed);
+}
+
+class SumTask: public rans::ThreadPool::Task {
+ public:
+  SumTask(std::vector<int>& v): _v(v) {}
+  void operator()(std::size_t begin, std::size_t end)
+  {
+    for (std::size_t i = begin; i < end; i++) {
+      if (_v[i] == -2) throw std::bad_alloc();
+      if (_v[i] == -3) throw 3;
+      if (_v[i] < 0) throw "negative";
+      _v[i] *= 2;
+    }
+  }
+ private:
+  std::vector<int>& _v;
+};
+
+TEST(ELEMENTAL_TEST, PARALLEL_CONSTRUCTION) {
+  rans::ThreadPool pool(4);
+  std::vector<int> v(10000, 1);
+  SumTask task(v);
+  pool.parallel_for(v.size(), task, 1);
+  ASSERT_EQ(20000, std::accumulate(v.begin(), v.end(), 0));
+  v[5000] = -1;
+  ASSERT_THROW(pool.parallel_for(v.size(), task, 1), const char*);
+
+  // errors are the same on the pool and inline.
+  rans::ThreadPool single(1);
+  v[5000] = -2;
+  ASSERT_THROW(pool.parallel_for(v.size(), task, 1), std::bad_alloc);
+  ASSERT_THROW(single.parallel_for(v.size(), task, 1), std::bad_alloc);
+  v[5000] = -3;
+  ASSERT_THROW(pool.parallel_for(v.size(), task, 1), const char*);
+  ASSERT_THROW(single.parallel_for(v.size(), task, 1), const char*);
+
+  // state ids don't depend on the number of threads.
+  const std::string regex = "(a|b)*a(a|b){10}";
+  rans::ThreadPool::shared().resize(1);
+  rans::DFA sequential(regex, rans::ASCII, false);
+  rans::ThreadPool::shared().resize(4);
+  rans::DFA parallel(regex, rans::ASCII, false);
+  rans::ThreadPool::shared().resize(0);
+  ASSERT_EQ(2048, sequential.size());
+  ASSERT_EQ(sequential.size(), parallel.size());
+  for (std::size_t i = 0; i < sequential.size(); i++) {
+    ASSERT_EQ(sequential[i].accept, parallel[i].accept);
+    ASSERT_TRUE(std::equal(sequential[i].t, sequential[i].t + 256, parallel[i].t));
+  }
+}
+
+TEST(ELEMENTAL_TEST, PARALLEL_PRODUCTS) {
+  // the products give the same results on one thread and on four.
+  const std::size_t n = 70;
+  rans::MPMatrix A(n), B(n), serial, parallel;
+  rans::MPVector v(n);
+  for (std::size_t i = 0; i < n; i++) {
+    v[i] = rans::Value("1234567890123456789") * (i + 1);
+    for (std::size_t j = 0; j < n; j++) {
+      A(i, j) = (i + j) % 3 == 0 ? rans::Value(0) : rans::Value("98765432109876543210") * (i + 1) + j;
+      B(i, j) = (i * j) % 5 + 1;
+    }
+  }
+  rans::MPVector w(v), big(200), big_serial, big_parallel;
+  for (std::size_t i = 0; i < big.size(); i++) big[i] = rans::Value(i + 1) * i;
+  rans::MPMatrix X(big.size());
+  for (std::size_t i = 0; i < big.size(); i++) {
+    for (std::size_t j = 0; j < big.size(); j++) X(i, j) = (i ^ j) % 7 == 0 ? 1 : 0;
+  }
+  big_serial = big;
+  big_parallel = big;
+  const rans::SparseMatrix& sparse = base_uri3986.sparse_adjacency_matrix();
+  rans::MPVector long_vector(sparse.size()), sparse_serial, sparse_parallel;
+  for (std::size_t i = 0; i < sparse.size(); i++) mpz_ui_pow_ui(long_vector[i].get_mpz_t(), 7, 4000 + i);
+  ASSERT_TRUE(sparse.nonzeros() * (long_vector.limbs() / sparse.size() + 1) >= rans::SparseMatrix::kParallelLimbs);
+
+  rans::ThreadPool::shared().resize(1);
+  rans::blocked_multiply(A, B, serial);
+  big_serial *= X;
+  rans::multiply(sparse, long_vector, sparse_serial);
+  rans::ThreadPool::shared().resize(4);
+  rans::blocked_multiply(A, B, parallel);
+  big_parallel *= X;
+  rans::multiply(sparse, long_vector, sparse_parallel);
+  rans::ThreadPool::shared().resize(0);
+
+  for (std::size_t i = 0; i < n; i++) {
+    for (std::size_t j = 0; j < n; j++) ASSERT_EQ(serial(i, j), parallel(i, j));
+  }
+  for (std::size_t i = 0; i < big.size(); i++) ASSERT_EQ(big_serial[i], big_parallel[i]);
+  for (std::size_t i = 0; i < sparse.size(); i++) ASSERT_EQ(sparse_serial[i], sparse_parallel[i]);
+}
+
+TEST(ELEMENTAL_TEST, BATCH_COMPILE) {
+  std::vector<RANS::Spec> specs;
+  specs.push_back(RANS::Spec("[0-9]+"));
+  specs.push_back(RANS::Spec("(a|b"));
+  specs.push_back(RANS::Spec("[\xe3\x81\x81-\xe3\x82\x93]+", RANS::CODEPOINT));
+  specs.push_back(RANS::Spec("abc", RANS::ASCII, false, true));
+  for (int i = 0; i < 32; i++) specs.push_back(RANS::Spec("(a|b)*a(a|b){6}"));
+
+  rans::ThreadPool::shared().resize(4);
+  RANS::Batch batch;
+  RANS::compile(specs, batch);
+  rans::ThreadPool::shared().resize(0);
+
+  ASSERT_EQ(specs.size(), batch.size());
+  ASSERT_TRUE(batch.ok(0));
+  ASSERT_FALSE(batch.ok(1));
+  ASSERT_NE(std::string::npos, batch.error(1).find("parse error"));
+  ASSERT_EQ(83, batch[2].count(1));
+  ASSERT_TRUE(batch[3].accept("aBc"));
+  for (std::size_t i = 4; i < batch.size(); i++) {
+    ASSERT_TRUE(batch.error(i).empty());
+    ASSERT_EQ(RANS(specs[i].regex).dfa(), batch[i].dfa());
+  }
+
+  // a released RANS outlives the batch; the rest go with it.
+  RANS* released = batch.release(0);
+  ASSERT_TRUE(batch.ok(0));
+  ASSERT_TRUE(batch.released(0));
+  ASSERT_FALSE(batch.released(1));
+  RANS::compile(std::vector<RANS::Spec>(), batch);
+  ASSERT_EQ(0, batch.size());
+  ASSERT_TRUE(released->accept("42"));
+  delete released;
+}
+
+TEST(ELEMENTAL_TEST, CONSTRUCTION_LIMITS) {
+  const std::string regex = "(a|b)*a(a|b){12}";
+  RANS states(regex, RANS::ASCII, false, false, true, rans::Limits(1000));
+  ASSERT_FALSE(states.ok());
+  ASSERT_NE(std::string::npos, states.error().find("state limit exceeded"));
+  RANS bytes(regex, RANS::ASCII, false, false, true, rans::Limits(0, 1 << 20));
+  ASSERT_FALSE(bytes.ok());
+  ASSERT_NE(std::string::npos, bytes.error().find("memory limit exceeded"));
+  RANS product("(a|b)*a(a|b){12}&.*", RANS::ASCII, false, false, true, rans::Limits(1000));
+  ASSERT_FALSE(product.ok());
+  ASSERT_TRUE(RANS("(a|b)*a(a|b){4}", RANS::ASCII, false, false, true, rans::Limits(1000)).ok());
+
+  // repetitions blow up in the parser, before any state is built.
+  const double start = rans::Budget::now();
+  rans::DFA clones("((a{1000}){1000}){8}", rans::ASCII, true, false, false, rans::Limits(1000, 1 << 20, 1.0));
+  ASSERT_FALSE(clones.ok());
+  ASSERT_NE(std::string::npos, clones.error().find("parse error: memory limit exceeded"));
+  ASSERT_GT(1.0, rans::Budget::now() - start);
+
+  // the estimate bounds the unminimized DFA, and is tight when the regex is deterministic.
+  const char* regexes[] = { "(a|b)*a(a|b){6}", "abc|abd", "[0-9]+(\\.[0-9]+)?", "(ab|cd)*e" };
+  for (std::size_t i = 0; i < sizeof(regexes) / sizeof(regexes[0]); i++) {
+    rans::DFA dfa(regexes[i], rans::ASCII, false);
+    ASSERT_LE(dfa.size(), rans::DFA::estimate(regexes[i])) << regexes[i];
+  }
+  ASSERT_EQ(rans::DFA("(ab|cd)*e", rans::ASCII, false).size(), rans::DFA::estimate("(ab|cd)*e"));
+  ASSERT_GE(4 * 128, rans::DFA::estimate("(a|b)*a(a|b){6}"));
+  ASSERT_EQ(0, rans::DFA::estimate("(a|b"));
+
+  // products are bounded from their operands, without being built.
+  const char* products[] = { "(ab|cd)*&(ab)*", "[a-z]+-abc", "~(abc)", "x(a+&a)*y", "(~a)(~a)" };
+  for (std::size_t i = 0; i < sizeof(products) / sizeof(products[0]); i++) {
+    rans::DFA dfa(products[i], rans::ASCII, false);
+    ASSERT_LE(dfa.size(), rans::DFA::estimate(products[i])) << products[i];
+  }
+  const double estimated = rans::Budget::now();
+  ASSERT_LE(rans::DFA::estimate("(a|b)*a(a|b){16}"), rans::DFA::estimate("(a|b)*a(a|b){16}&.*"));
+  ASSERT_GT(1.0, rans::Budget::now() - estimated);
+}
+
+TEST(ELEMENTAL_TEST, MEMOIZED_GROUPS) {
+  // repeated products are cloned from their first occurrence, and must
+  // give the same language as groups spelled differently.
+  const std::string octet = "(\\d|[1-9]\\d|1\\d{2}|2[0-4]\\d|25[0-5])";
+  const std::string spelled = "([0-9]|[1-9][0-9]|1[0-9]{2}|2[0-4][0-9]|25[0-5])";
+  RANS ipv4(octet + "\\." + octet + "\\." + octet + "\\." + octet);
+  RANS distinct(octet + "\\." + spelled + "\\." + "(" + spelled + ")" + "\\." + "((" + spelled + "))");
+  ASSERT_TRUE(ipv4.ok());
+  ASSERT_TRUE(distinct.ok());
+  ASSERT_EQ(distinct.dfa().size(), ipv4.dfa().size());
+  ASSERT_EQ(distinct.count(15), ipv4.count(15));
+  ASSERT_TRUE(ipv4.dfa().accept("192.168.0.255"));
+  ASSERT_FALSE(ipv4.dfa().accept("192.168.0.256"));
+
+  const char* regexes[][2] = {
+    { "(a)(a)*(a)", "aa+" },
+    { "([)])([)])", "\\)\\)" },
+    { "(\\))(\\))", "\\)\\)" },
+    { "(ab)c(ab)(abc)", "abcababc" },
+    { "(a|b&a)(a|b&a)*", "a+" },
+  };
+  for (std::size_t i = 0; i < sizeof(regexes) / sizeof(regexes[0]); i++) {
+    rans::DFA lhs(regexes[i][0]), rhs(regexes[i][1]);
+    ASSERT_TRUE(lhs.ok()) << regexes[i][0];
+    ASSERT_EQ(rhs.size(), lhs.size()) << regexes[i][0];
+    rans::DFA diff(lhs, rhs, rans::DFA::DIFFERENCE, rans::Budget());
+    ASSERT_EQ(1u, diff.size()) << regexes[i][0];
+    ASSERT_FALSE(diff.accept("")) << regexes[i][0];
+  }
+  ASSERT_FALSE(rans::Parser("(a)(a", rans::ASCII).ok());
+
+  // products are memoized by structure, however their operands are spelled.
+  const std::string product = "(\\d+&[0-9]*1)";
+  rans::Parser shared(product + "x([0-9]+&\\d*1)y" + product + "|~" + product, rans::ASCII);
+  ASSERT_TRUE(shared.ok());
+  ASSERT_EQ(3u, shared.reused());
+  ASSERT_EQ(0u, rans::Parser("(\\d+&[0-9]*1)(\\d+&[0-9]*2)", rans::ASCII).reused());
+}
+
+TEST(ELEMENTAL_TEST, SHARED_CLASS_TABLES) {
+  // equal classes share one table, which must stay apart from its negation.
+  RANS r("[a-c][^a-c][a-c]\\d[0-9][b-c]");
+  ASSERT_TRUE(r.accept("axb10c"));
+  ASSERT_FALSE(r.accept("aab10c"));
+  ASSERT_FALSE(r.accept("axb10a"));
+  ASSERT_EQ(3 * 253 * 3 * 10 * 10 * 2, r.amount());
+  ASSERT_TRUE(RANS("[a]b").accept("ab"));
+}
+
+TEST(ELEMENTAL_TEST, FACTOR_AUTOMATON) {
+  // the factorial DFA accepts exactly the substrings of the words.
+  rans::DFA base("(ab|cd)*e"), factors("(ab|cd)*e", rans::ASCII, true, true);
+  ASSERT_TRUE(factors.ok());
+  std::set<std::string> substrings;
+  std::vector<std::string> texts(1, "");
+  for (std::size_t i = 0; i < texts.size(); i++) {
+    if (base.accept(texts[i])) {
+      for (std::size_t b = 0; b <= texts[i].length(); b++) {
+        for (std::size_t e = b; e <= texts[i].length(); e++) substrings.insert(texts[i].substr(b, e - b));
+      }
+    }
+    if (texts[i].length() < 7) {
+      for (char c = 'a'; c <= 'e'; c++) texts.push_back(texts[i] + c);
+    }
+  }
+  for (std::size_t i = 0; i < texts.size() && texts[i].length() <= 5; i++) {
+    ASSERT_EQ(substrings.count(texts[i]) == 1, factors.accept(texts[i])) << texts[i];
+  }
+  ASSERT_TRUE(rans::DFA("x{0}y", rans::ASCII, true, true).accept("y"));
+  ASSERT_FALSE(rans::DFA("x{0}y", rans::ASCII, true, true).accept("x"));
+}
+
+TEST(ELEMENTAL_TEST, UNION_RANKING) {
+  // ranks of disjoint branches add up to the ranks of their union.
+  const char* branches[] = { "[0-9]+", "[a-c]+(x|yy)", "(ab)*z", "" };
+  std::vector<std::string> regexes(branches, branches + 4);
+  UnionRANS u(regexes);
+  RANS r("[0-9]+|[a-c]+(x|yy)|(ab)*z|x{0}");
+  ASSERT_TRUE(r.ok());
+  ASSERT_TRUE(u.ok()) << u.error();
+  ASSERT_EQ(r.amount(), u.amount());
+  ASSERT_EQ(r.count(5), u.count(5));
+  for (int i = 0; i < 5000; i += 7) {
+    std::string text = r.rep(i);
+    ASSERT_EQ(text, u.rep(i)) << i;
+    ASSERT_EQ(i, u.val(text)) << text;
+  }
+  const std::string text = "cababcabcabcabyy";
+  ASSERT_EQ(r.val(text), u.val(text));
+  ASSERT_EQ(text, u.rep(r.val(text)));
+  ASSERT_EQ(r.val("ababz"), r.below("ababz"));
+  ASSERT_EQ(r.val("ababz"), r.below("ababy"));
+  ASSERT_EQ(r.amount(5), r.below("!!!!!!"));
+  ASSERT_THROW(u.val("abxy"), rans::Exception);
+
+  std::vector<std::string> finite(1, "a|b");
+  finite.push_back("c{1,3}");
+  UnionRANS f(finite);
+  ASSERT_EQ(5, f.amount());
+  ASSERT_EQ("ccc", f.rep(4));
+  ASSERT_THROW(f.rep(5), rans::Exception);
+
+  regexes.push_back("a*");
+  ASSERT_FALSE(UnionRANS(regexes).ok());
+  ASSERT_NE(std::string::npos, UnionRANS(regexes).error().find("branches 3 and 4"));
+
+  // the branches are checked in one walk, which finds overlaps past START.
+  const char* overlapping[] = { "x[0-9]+", "y", "x(1|22)", "z*" };
+  UnionRANS overlap(std::vector<std::string>(overlapping, overlapping + 4));
+  ASSERT_FALSE(overlap.ok());
+  ASSERT_NE(std::string::npos, overlap.error().find("branches 0 and 2"));
+  std::vector<std::string> words;
+  for (std::size_t i = 0; i < 500; i++) {
+    std::stringstream word;
+    word << "w" << i;
+    words.push_back(word.str());
+  }
+  ASSERT_EQ(500, UnionRANS(words).amount());
+}
+
+// a language with both finite and infinite branches, whose adjacency
+// matrix the tests of the ranking internals below share.
+RANS sample("(a|bc)*(d|ef)+|x[0-9]{3,}");
+
+// Y == X, entry by entry.
+static bool equal(const rans::MPMatrix& X, const rans::MPMatrix& Y)
+{
+  if (X.size() != Y.size()) return false;
+  for (std::size_t i = 0; i < X.size(); i++) {
+    for (std::size_t j = 0; j < X.size(); j++) {
+      if (X(i, j) != Y(i, j)) return false;
+    }
+  }
+  return true;
+}
+
+TEST(ELEMENTAL_TEST, POWER_LADDER) {
+  // square-and-multiply and the cached squares give the naive powers,
+  // also when the cache is (almost) disabled.
+  const rans::MPMatrix& X = sample.adjacency_matrix();
+  rans::PowerLadder cached, uncached;
+  cached.reset(X);
+  uncached.reset(X, 1);
+  rans::MPMatrix naive = rans::MPIdentityMatrix(sample.size()), Y, Z, tmp;
+  for (std::size_t n = 0; n <= 40; n++) {
+    rans::power(X, n, Y);
+    ASSERT_TRUE(equal(naive, Y)) << n;
+    ASSERT_TRUE(equal(naive, cached.power(n, Y))) << n;
+    ASSERT_TRUE(equal(naive, uncached.power(n, Z))) << n;
+    naive *= X;
+  }
+  ASSERT_EQ(X.bytes(), uncached.bytes());
+
+  // squares past the cache are computed into tmp, from the last cached one.
+  for (std::size_t k = 0; k < 6; k++) {
+    rans::power(X, static_cast<std::size_t>(1) << k, Y);
+    ASSERT_TRUE(equal(Y, cached.square(k, tmp))) << k;
+    ASSERT_TRUE(equal(Y, uncached.square(k, tmp))) << k;
+  }
+  ASSERT_EQ(X.bytes(), uncached.bytes());
+  ASSERT_LT(X.bytes(), cached.bytes());
+}
+
+TEST(ELEMENTAL_TEST, SUFFIX_TABLE) {
+  // the rows are the counts from START, and the table stops growing at
+  // its memory limit.
+  rans::MPVector accept(sample.size());
+  for (std::size_t i = 0; i < sample.size(); i++) accept[i] = sample.dfa().accept(i) ? 1 : 0;
+  const rans::SparseMatrix& transitions = sample.sparse_adjacency_matrix();
+  rans::SuffixTable table;
+  table.reset(transitions, accept);
+  for (std::size_t l = 0; l < 30; l++) ASSERT_EQ(sample.count(l), (*table.row(l))[rans::DFA::START]);
+  table.reset(transitions, accept, table.bytes());
+  ASSERT_TRUE(table.row(29) != NULL);
+  ASSERT_TRUE(table.row(30) == NULL);
+
+  // past the rows of a limited table, rep() falls back to matrix powers.
+  RANS limited("(a|bc)*(d|ef)+|x[0-9]{3,}", RANS::ASCII, false, false, true, rans::Limits(0, 1 << 16));
+  ASSERT_TRUE(limited.ok());
+  rans::Value value;
+  mpz_ui_pow_ui(value.get_mpz_t(), 10, 300);
+  ASSERT_EQ(sample.rep(value), limited.rep(value));
+  ASSERT_EQ(value, limited.val(limited.rep(value)));
+}
+
+TEST(ELEMENTAL_TEST, BLOCKED_PRODUCT) {
+  // block borders, and an output which is reused or aliased, don't change
+  // the textbook product.
+  const std::size_t n = 70;
+  rans::MPMatrix A(n), B(n), C, naive(n);
+  for (std::size_t i = 0; i < n; i++) {
+    for (std::size_t j = 0; j < n; j++) {
+      A(i, j) = (i * 7 + j * 3) % 5 == 0 ? rans::Value(0) : rans::Value("123456789012345678901") * (i + 1) - j;
+      B(i, j) = rans::Value("98765432109876543210") * (j + 1) - i;
+    }
+  }
+  for (std::size_t i = 0; i < n; i++) {
+    for (std::size_t j = 0; j < n; j++) {
+      for (std::size_t k = 0; k < n; k++) naive(i, j) += A(i, k) * B(k, j);
+    }
+  }
+  rans::multiply(A, B, C);
+  rans::multiply(A, B, C);
+  for (std::size_t i = 0; i < n; i++) {
+    for (std::size_t j = 0; j < n; j++) ASSERT_EQ(naive(i, j), C(i, j));
+  }
+  A *= B;
+  for (std::size_t i = 0; i < n; i++) {
+    for (std::size_t j = 0; j < n; j++) ASSERT_EQ(naive(i, j), A(i, j));
+  }
+}
+
+TEST(ELEMENTAL_TEST, WINOGRAD_PRODUCT) {
+  // Strassen-Winograd on odd and even sizes, negative entries and entries
+  // past the limb threshold gives the blocked product.
+  const std::size_t sizes[] = {1, 2, 7, 30, 65};
+  for (std::size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    const std::size_t n = sizes[s];
+    rans::MPMatrix A(n), B(n), C, D;
+    rans::Value big;
+    mpz_ui_pow_ui(big.get_mpz_t(), 3, 64 * 22);
+    for (std::size_t i = 0; i < n; i++) {
+      for (std::size_t j = 0; j < n; j++) {
+        A(i, j) = big * (i + 1) - rans::Value(j * j);
+        B(i, j) = (i + j) % 3 == 0 ? rans::Value(0) : big * (j + 2) - rans::Value(i * 7);
+        if ((i * j) % 4 == 1) B(i, j) = -B(i, j);
+      }
+    }
+    ASSERT_TRUE(A.limbs() >= rans::MPMatrix::kWinogradLimbs);
+    rans::blocked_multiply(A, B, C);
+    rans::winograd_multiply(A, B, D);
+    for (std::size_t i = 0; i < n; i++) {
+      for (std::size_t j = 0; j < n; j++) ASSERT_EQ(C(i, j), D(i, j)) << n;
+    }
+    A *= B;
+    for (std::size_t i = 0; i < n; i++) {
+      for (std::size_t j = 0; j < n; j++) ASSERT_EQ(C(i, j), A(i, j)) << n;
+    }
+  }
+}
+
+TEST(ELEMENTAL_TEST, HYBRID_VECTOR) {
+  // words and big integers give the same products, and vectors move to
+  // big integers before they could overflow.
+  const rans::SparseMatrix& X = sample.sparse_adjacency_matrix();
+  rans::HybridVector hybrid(sample.size()), buffer;
+  rans::MPVector dense(sample.size()), tmp;
+  for (std::size_t i = 0; i < sample.size(); i++) {
+    hybrid.add(i, i + 1);
+    dense[i] = i + 1;
+  }
+  rans::Value expected, value;
+  for (std::size_t n = 0; n < 200; n++) {
+    rans::multiply(hybrid, X, buffer);
+    hybrid.swap(buffer);
+    rans::multiply(dense, X, tmp);
+    dense.swap(tmp);
+    hybrid.add(n % sample.size(), 12345);
+    dense[n % sample.size()] += 12345;
+    expected = value = 0;
+    rans::MPVector::inner_prod(dense, dense, expected);
+    hybrid.inner_prod(dense, value);
+    ASSERT_EQ(expected, value) << n;
+    if (mpz_sizeinbase(expected.get_mpz_t(), 2) < rans::HybridVector::kBits / 2) {
+      ASSERT_FALSE(hybrid.promoted()) << n;
+    }
+  }
+  ASSERT_TRUE(hybrid.promoted());
+
+  // ranks just below and above the words.
+  RANS alpha("[a-z]+");
+  rans::Value word;
+  mpz_ui_pow_ui(word.get_mpz_t(), 2, rans::HybridVector::kBits);
+  for (int d = -3; d <= 3; d++) {
+    const rans::Value v = word + d;
+    ASSERT_EQ(v, alpha.val(alpha.rep(v)));
+  }
+  ASSERT_EQ(std::string(27, 'z'), alpha.rep(alpha.val(std::string(27, 'z'))));
+}
+
+TEST(ELEMENTAL_TEST, LINEAR_RECURRENCE) {
+  // Berlekamp-Massey finds the recurrences, and their terms agree with the
+  // matrix powers, for infinite and finite languages alike.
+  std::vector<rans::Value> fibonacci(10, 1), coefficients;
+  for (std::size_t n = 2; n < fibonacci.size(); n++) fibonacci[n] = fibonacci[n-1] + fibonacci[n-2];
+  rans::Recurrence::berlekamp_massey(fibonacci, coefficients);
+  ASSERT_EQ(2, coefficients.size());
+  ASSERT_EQ(1, coefficients[0]);
+  ASSERT_EQ(1, coefficients[1]);
+
+  RANS finite("abc|de"), overlapping("a*b*|b*c*"), even("(ab|cd)*"), epsilon("[^a]{0,5}x{0}");
+  const RANS* languages[] = { &sample, &finite, &overlapping, &even, &epsilon };
+  for (std::size_t r = 0; r < sizeof(languages) / sizeof(languages[0]); r++) {
+    const RANS& language = *languages[r];
+    rans::MPMatrix power;
+    for (std::size_t length = 0; length < 40; length++) {
+      rans::power(language.adjacency_matrix(), length, power);
+      rans::Value count;
+      for (std::size_t i = 0; i < language.size(); i++) {
+        if (language.dfa().accept(i)) count += power(rans::DFA::START, i);
+      }
+      ASSERT_EQ(count, language.count(length)) << r << " " << length;
+      ASSERT_EQ(language.amount(length) - (length == 0 ? rans::Value(0) : language.amount(length - 1)), count);
+    }
+  }
+
+  std::vector<rans::Value> terms(2 * base_uri2396.size() + 2), modular;
+  for (std::size_t n = 0; n < terms.size(); n++) terms[n] = base_uri2396.count(n + 1);
+  rans::Recurrence::berlekamp_massey(terms, coefficients);
+  ASSERT_TRUE(rans::Recurrence::modular_berlekamp_massey(terms, modular));
+  ASSERT_TRUE(coefficients == modular);
+}
+
+TEST(ELEMENTAL_TEST, SPARSE_PRODUCT) {
+  // v*X, A*X, X*A and X*v over the CSR adjacency matrix equal the dense products.
+  const rans::SparseMatrix& X = sample.sparse_adjacency_matrix();
+  const rans::MPMatrix& dense_X = sample.adjacency_matrix();
+  const std::size_t n = sample.size();
+  ASSERT_EQ(n, X.size());
+  ASSERT_LT(X.nonzeros(), n * n);
+  rans::MPVector dense(n), sparse;
+  for (std::size_t i = 0; i < n; i++) dense[i] = rans::Value("98765432109876543210") * (i + 1);
+  rans::multiply(dense, X, sparse);
+  dense *= dense_X;
+  for (std::size_t i = 0; i < n; i++) ASSERT_EQ(dense[i], sparse[i]);
+
+  rans::MPMatrix A(n), product, expected;
+  for (std::size_t i = 0; i < n; i++) {
+    for (std::size_t j = 0; j < n; j++) A(i, j) = rans::Value("12345678901234567890") * (i + 2 * j + 1);
+  }
+  rans::multiply(A, X, product);
+  expected = A;
+  expected *= dense_X;
+  ASSERT_TRUE(equal(expected, product));
+  rans::multiply(X, A, product);
+  expected = dense_X;
+  expected *= A;
+  ASSERT_TRUE(equal(expected, product));
+  rans::MPVector column(n), column_product;
+  for (std::size_t i = 0; i < n; i++) column[i] = A(i, 0);
+  rans::multiply(X, column, column_product);
+  for (std::size_t i = 0; i < n; i++) ASSERT_EQ(expected(i, 0), column_product[i]);
+
+  // val() of a long text sums its suffix counts over the sparse transitions.
+  const std::string text = "x" + std::string(200, '7');
+  ASSERT_EQ(sample.val(text) + 1, sample.val("x" + std::string(199, '7') + "8"));
+}